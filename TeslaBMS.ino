@@ -23,6 +23,9 @@ clock_t get_delta_time_ms()
 #define RXD2 16
 #define TXD2 17
 
+//UART driver events (data received), loop() sleeps on them
+static QueueHandle_t uart_queue;
+
 void esp_idf_uart_init()
 {
 	uart_config_t uart_config = {
@@ -42,7 +45,7 @@ void esp_idf_uart_init()
 
 	// Install UART driver using an event queue here
 	const int uart_buffer_size = (1024 * 2);
-	ESP_ERROR_CHECK(uart_driver_install(UART_NUM_2, uart_buffer_size, uart_buffer_size, 10, NULL, 0));
+	ESP_ERROR_CHECK(uart_driver_install(UART_NUM_2, uart_buffer_size, uart_buffer_size, 10, &uart_queue, 0));
 }
 
 void esp_idf_uart_write(uint8_t *data, uint8_t dataLen)
@@ -50,25 +53,26 @@ void esp_idf_uart_write(uint8_t *data, uint8_t dataLen)
 	uart_write_bytes(UART_NUM_2, data, dataLen);
 }
 
-bool esp_idf_uart_available()
+//Reads whatever is already buffered (up to "len" bytes), does not block
+size_t esp_idf_uart_read(uint8_t *data, size_t len)
 {
-	int len = 0;
-
-	ESP_ERROR_CHECK(uart_get_buffered_data_len(UART_NUM_2, (size_t*)&len));
+	int read = uart_read_bytes(UART_NUM_2, data, len, 0);
 
-	return (len > 0);
+	return read > 0 ? (size_t)read : 0;
 }
 
-uint8_t esp_idf_uart_read()
+void esp_idf_uart_flush()
 {
-	uint8_t byte;
-	uart_read_bytes(UART_NUM_2, &byte, 1, 0);
-	return byte;
+	uart_flush(UART_NUM_2);
 }
 
-void esp_idf_uart_flush()
+//Blocks until UART receives something or "ms" pass
+void esp_idf_uart_wait(clock_t ms)
 {
-	uart_flush(UART_NUM_2);
+	uart_event_t event;
+
+	if (ms > 0)
+		xQueueReceive(uart_queue, &event, pdMS_TO_TICKS(ms));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -77,7 +81,28 @@ void esp_idf_uart_flush()
 
 struct tbms tb;
 
-void print_stats(clock_t delta)
+//Debug records, printed by log_task so UART output can not delay IO
+struct tbms_log tb_log;
+
+//Lower priority than loop(), runs while loop() waits for UART or deadline
+void log_task(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		//Records wait in the ring meanwhile (counted in "lost" if full)
+		if (!tbms_log_drain(&tb_log, stdout, 16))
+			vTaskDelay(pdMS_TO_TICKS(10));
+	}
+}
+
+//UART chunk that was not yet consumed by library
+static uint8_t rx_buf[128];
+static size_t  rx_len = 0;
+static size_t  rx_pos = 0;
+
+//Returns ms until stats are printed again
+clock_t print_stats(clock_t delta)
 {
 	static async state;
 	static clock_t timer = 0;
@@ -87,11 +112,11 @@ void print_stats(clock_t delta)
 	printf("PACK VOLTAGE %f\n", tbms_get_module_voltage(&tb, 0));
 	printf("PACK TEMP    %f\n", tbms_get_module_temp1(&tb, 0));
 	
-	ASYNC_AWAIT((timer += delta) >= 1000, return);
+	ASYNC_AWAIT((timer += delta) >= 1000, return 1000 - timer);
 	
 	timer = 0;
 	
-	ASYNC_RESET(return);
+	ASYNC_RESET(return 0);
 }
 
 void setup()
@@ -100,14 +125,20 @@ void setup()
 	Serial.begin(115200);
 	esp_idf_uart_init();
 	tbms_init(&tb);
+	tbms_log_init(&tb_log);
+	tbms_set_log(&tb, &tb_log);
+
+	xTaskCreate(log_task, "tbms_log", 4096, NULL, tskIDLE_PRIORITY, NULL);
 }
 
 void loop()
 {
 	clock_t delta = get_delta_time_ms();
+	clock_t sleep;
 	
 	if (tbms_tx_available(&tb)) {
 		esp_idf_uart_flush(); //Flush RX buffer before TX;
+		rx_pos = rx_len = 0;
 		
 		esp_idf_uart_write(tbms_get_tx_buf(&tb), tbms_get_tx_len(&tb));
 		
@@ -119,16 +150,31 @@ void loop()
 		tbms_tx_flush(&tb);
 	}
 	
-	if (tbms_rx_available(&tb) && esp_idf_uart_available()) {
-		uint8_t c = esp_idf_uart_read();
-		tbms_set_rx(&tb, c);
-		//printf("got: 0x%02X\n", c);
+	if (tbms_rx_available(&tb)) {
+		if (rx_pos >= rx_len) {
+			rx_len = esp_idf_uart_read(rx_buf, sizeof(rx_buf));
+			rx_pos = 0;
+		}
+
+		rx_pos += tbms_set_rx_buf(&tb, &rx_buf[rx_pos], rx_len - rx_pos);
 	}
 
-	/*if (tb.tb.io.state == TBMS_IO_STATE_WAIT_FOR_REPLY)
+	/*if (tb.io.state == TBMS_IO_STATE_WAIT_FOR_REPLY)
 		printf("ready = %i\n", tb.tb.io.ready ? 1 : 0);*/
 
-	print_stats(delta);
+	sleep = print_stats(delta);
 
 	tbms_update(&tb, delta);
+
+	//Nothing to do until a reply arrives or library deadline passes
+	if (tbms_next_deadline(&tb) < sleep)
+		sleep = tbms_next_deadline(&tb);
+
+	if (tbms_rx_available(&tb) && rx_pos < rx_len)
+		sleep = 0;
+
+	if (tbms_tx_available(&tb))
+		sleep = 0;
+
+	esp_idf_uart_wait(sleep);
 }
@@ -0,0 +1,39 @@
+gcc tesla_bms.bench.c -std=c99 -Wall -Wextra -O2 -o crc_bench -lm
+
+if ./crc_bench > bench_output.txt; then
+	echo "CRC benchmark passed: All variants agree."
+else
+	echo "CRC benchmark failed: Variants disagree."
+fi
+
+for n in 2 16 62; do
+	gcc tesla_bms.bench.c -std=c99 -O2 -lm -DTBMS_MAX_MODULES=$n -o size_report
+	./size_report | head -n 1
+done
+
+cat bench_output.txt
+
+gcc tbms_sweep.bench.c -std=gnu99 -Wall -Wextra -O2 -o sweep_bench -lm
+
+if ./sweep_bench sweep_baseline.txt > sweep_output.txt; then
+	echo "Sweep benchmark passed: No regression against sweep_baseline.txt."
+else
+	echo "Sweep benchmark failed: Regression against sweep_baseline.txt."
+fi
+
+gcc tbms_burst.bench.c -std=gnu99 -Wall -Wextra -O2 -o burst_bench -lm
+
+./burst_bench
+
+#Whole chain with burst reads, compare with sweep_output.txt
+gcc tbms_sweep.bench.c -std=gnu99 -O2 -DTBMS_BURST_READ -o sweep_bench -lm
+./sweep_bench > sweep_burst_output.txt
+
+#Whole chain with debug log attached, compare ns_per_update with sweep_output.txt
+gcc tbms_sweep.bench.c -std=gnu99 -O2 -DTBMS_DEBUG -o sweep_log_bench -lm
+
+if ./sweep_log_bench sweep_baseline.txt > sweep_log_output.txt; then
+	echo "Sweep benchmark with log passed: No regression against sweep_baseline.txt."
+else
+	echo "Sweep benchmark with log failed: Regression against sweep_baseline.txt."
+fi
@@ -1,4 +1,4 @@
-gcc tesla_bms.test.c -std=c99 -Wall -Wextra -g
+gcc tesla_bms.test.c -std=c99 -Wall -Wextra -g -o a -lm
 
 ./a > output.txt
 
@@ -8,3 +8,71 @@ if git --no-pager diff -u --word-diff --color=always \
 else
 	echo "Test failed: Output differs from expected output."
 fi
+
+gcc tbms_host.test.c -std=gnu99 -Wall -Wextra -g -o host_test -lm
+
+if ./host_test; then
+	echo "Host test passed: All buses behave as expected."
+else
+	echo "Host test failed."
+fi
+
+gcc tbms_trace.test.c -std=c99 -Wall -Wextra -g -o trace_test -lm
+
+if ./trace_test; then
+	echo "Trace test passed: Recorded session replays exactly."
+else
+	echo "Trace test failed."
+fi
+
+gcc tbms_snapshot.test.c -std=gnu99 -Wall -Wextra -g -o snapshot_test -lm -pthread
+
+if ./snapshot_test; then
+	echo "Snapshot test passed: Readers never saw a torn pack."
+else
+	echo "Snapshot test failed."
+fi
+
+gcc tbms_balance.test.c -std=c99 -Wall -Wextra -g -o balance_test -lm
+
+if ./balance_test; then
+	echo "Balance test passed: Timer, thresholds and writes as expected."
+else
+	echo "Balance test failed."
+fi
+
+gcc tbms_pack.test.c -std=c99 -Wall -Wextra -g -o pack_test -lm
+
+if ./pack_test; then
+	echo "Pack test passed: Aggregates match a full scan."
+else
+	echo "Pack test failed."
+fi
+
+#Same tests with integer measurements, output must not change
+gcc tesla_bms.test.c -std=c99 -Wall -Wextra -g -DTBMS_FIXED_POINT -o a_fixed -lm
+
+./a_fixed > output_fixed.txt
+
+if git --no-pager diff -u --word-diff --color=always \
+       --no-index good_output.txt output_fixed.txt; then
+	echo "Fixed point test passed: Output matches expected output."
+else
+	echo "Fixed point test failed: Output differs from expected output."
+fi
+
+gcc tbms_balance.test.c -std=c99 -Wall -Wextra -g -DTBMS_FIXED_POINT -o balance_test_fixed -lm
+
+if ./balance_test_fixed; then
+	echo "Fixed point balance test passed: Timer, thresholds and writes as expected."
+else
+	echo "Fixed point balance test failed."
+fi
+
+gcc tbms_pack.test.c -std=c99 -Wall -Wextra -g -DTBMS_FIXED_POINT -o pack_test_fixed -lm
+
+if ./pack_test_fixed; then
+	echo "Fixed point pack test passed: Aggregates match a full scan."
+else
+	echo "Fixed point pack test failed."
+fi
@@ -0,0 +1,210 @@
+#include "tesla_bms.h"
+#include "tbms_emu.h"
+
+/* Library balances emulated modules for several periods of the hardware
+ * balance timer (see TBMS_BALANCE_TIME). Balancing must be re-armed before
+ * the timer of a module runs out, BAL_CTRL may only be cleared by the
+ * library itself. Thresholds set at runtime (tbms_set_balance_config) select
+ * cells against the pack minimum, balance registers are only written when
+ * selection changes (or timer is re-armed). */
+
+#define MODULES 2
+#define PERIODS 3
+
+static struct tbms     tb;
+static struct tbms_emu emu;
+
+//Writes to BAL_CTRL and BAL_TIME of any module
+static unsigned ctrl_writes, time_writes;
+
+void update()
+{
+	if (tbms_tx_available(&tb)) {
+		uint8_t *buf = tbms_get_tx_buf(&tb);
+
+		if (buf[0] & TBMS_WRITE) {
+			ctrl_writes += buf[1] == TBMS_REG_BAL_CTRL;
+			time_writes += buf[1] == TBMS_REG_BAL_TIME;
+		}
+
+		tbms_emu_flush(&emu);
+		tbms_emu_write(&emu, buf, tbms_get_tx_len(&tb));
+		tbms_tx_flush(&tb);
+	}
+
+	if (tbms_rx_available(&tb)) {
+		size_t len;
+		uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+		tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+	}
+
+	tbms_emu_update(&emu, 1);
+	tbms_update(&tb, 1);
+}
+
+//Hardware timer keeps balancing through PERIODS timer periods
+int test_timer(void)
+{
+	clock_t end = PERIODS * TBMS_BAL_TIME_MS(TBMS_BALANCE_TIME) + 10000;
+	unsigned expired = 0, armed = 0;
+
+	tbms_emu_init(&emu, MODULES);
+	tbms_emu_set_cell(&emu, 0, 0, 3.85f);
+	tbms_emu_set_cell(&emu, 1, 3, 3.85f);
+
+	tbms_init(&tb);
+
+	for (clock_t t = 0; t < end; t++) {
+		uint8_t ctrl[MODULES];
+		clock_t timer[MODULES];
+
+		for (int i = 0; i < MODULES; i++) {
+			ctrl[i]  = emu.module[i].reg[TBMS_REG_BAL_CTRL];
+			timer[i] = emu.module[i].bal_timer;
+		}
+
+		update();
+
+		for (int i = 0; i < MODULES; i++) {
+			struct tbms_emu_module *m = &emu.module[i];
+
+			//Cleared by timer instead of a write of the library
+			if (ctrl[i] && !m->reg[TBMS_REG_BAL_CTRL] &&
+			    !m->bal_timer && timer[i] &&
+			    tbms_get_module_balance_bits(&tb, (uint8_t)i)) {
+				printf("module %i: timer expired at %li ms\n",
+				       i, (long)t);
+				expired++;
+			}
+
+			armed += m->bal_timer > timer[i] &&
+				 m->reg[TBMS_REG_BAL_CTRL];
+		}
+	}
+
+	//Every module is armed once and re-armed in every period after
+	bool ok = !expired && armed >= MODULES * PERIODS &&
+		  emu.module[0].reg[TBMS_REG_BAL_CTRL] == 0x01 &&
+		  emu.module[1].reg[TBMS_REG_BAL_CTRL] == 0x08;
+
+	printf("balance timer: %u armed, %u expired, %s\n", armed, expired,
+	       ok ? "OK" : "FAIL");
+
+	return !ok;
+}
+
+void run(clock_t ms)
+{
+	for (clock_t t = 0; t < ms; t++)
+		update();
+}
+
+//Returns 1 if balance bits of modules (library and BAL_CTRL) differ
+int expect_bits(const char *name, uint8_t bits0, uint8_t bits1)
+{
+	uint8_t bits[MODULES] = { bits0, bits1 };
+	bool ok = true;
+
+	for (int i = 0; i < MODULES; i++)
+		ok = ok && tbms_get_module_balance_bits(&tb, (uint8_t)i) ==
+			   bits[i] &&
+		     emu.module[i].reg[TBMS_REG_BAL_CTRL] == bits[i];
+
+	printf("%s: %02x %02x, %s\n", name,
+	       emu.module[0].reg[TBMS_REG_BAL_CTRL],
+	       emu.module[1].reg[TBMS_REG_BAL_CTRL], ok ? "OK" : "FAIL");
+
+	return !ok;
+}
+
+//Thresholds changed at runtime, balancing against pack minimum
+int test_config(void)
+{
+	static const float cells[MODULES][TBMS_MODULE_CELLS] = {
+		{ 3.70f, 3.75f, 3.81f, 3.86f, 3.91f, 3.70f },
+		{ 3.60f, 3.65f, 3.65f, 3.65f, 3.65f, 3.65f },
+	};
+	int failed = 0;
+
+	tbms_emu_init(&emu, MODULES);
+
+	for (int i = 0; i < MODULES; i++)
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			tbms_emu_set_cell(&emu, (uint8_t)i, (uint8_t)j,
+					  cells[i][j]);
+
+	tbms_init(&tb);
+
+	//Defaults, voltage decides
+	run(10000);
+	failed += expect_bits("3.80V 40mV", 0x1C, 0x00);
+
+	//Lower voltage, hysteresis above pack minimum (3.60V) decides
+	tbms_set_balance_config(&tb, 3720, 100);
+	run(10000);
+	failed += expect_bits("3.72V 100mV", 0x1E, 0x00);
+
+	tbms_set_balance_config(&tb, 3500, 200);
+	run(10000);
+	failed += expect_bits("3.50V 200mV", 0x1C, 0x00);
+
+	//Pack minimum (other module) moves up, 3.81V cell stops balancing
+	tbms_emu_set_cell(&emu, 1, 0, 3.65f);
+	run(10000);
+	failed += expect_bits("pack min 3.65V", 0x18, 0x00);
+
+	//Nothing is rewritten while balanced cells stay the same
+	ctrl_writes = time_writes = 0;
+	run(TBMS_BALANCE_REARM - 10000);
+
+	bool ok = !ctrl_writes && !time_writes;
+
+	printf("stable for %li ms: %u BAL_CTRL, %u BAL_TIME writes, %s\n",
+	       (long)(TBMS_BALANCE_REARM - 10000), ctrl_writes, time_writes,
+	       ok ? "OK" : "FAIL");
+	failed += !ok;
+
+	//Re-arm clears and sets BAL_CTRL once, BAL_TIME is unchanged
+	run(20000);
+
+	ok = ctrl_writes == 2 && !time_writes;
+
+	printf("re-armed: %u BAL_CTRL, %u BAL_TIME writes, %s\n",
+	       ctrl_writes, time_writes, ok ? "OK" : "FAIL");
+	failed += !ok;
+
+	//Balanced cells approach full duty, others (once balanced too) none
+	ok = true;
+
+	for (int i = 0; i < MODULES; i++) {
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++) {
+			float duty = tbms_get_module_cell_balance_duty(
+				&tb, (uint8_t)i, (uint8_t)j);
+
+			if (i == 0 && (j == 3 || j == 4))
+				ok = ok && duty > 0.9f;
+			else
+				ok = ok && duty < 0.1f;
+		}
+	}
+
+	printf("duty %.2f %.2f %.2f, %s\n",
+	       tbms_get_module_cell_balance_duty(&tb, 0, 4),
+	       tbms_get_module_cell_balance_duty(&tb, 0, 2),
+	       tbms_get_module_cell_balance_duty(&tb, 0, 1),
+	       ok ? "OK" : "FAIL");
+	failed += !ok;
+
+	return failed;
+}
+
+int main()
+{
+	int failed = 0;
+
+	failed += test_timer();
+	failed += test_config();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE //clock_gettime
+
+#include "tesla_bms.h"
+#include "tbms_emu.h"
+
+/* Reading values and status of one module: two reads (GPAI, ALERT_STATUS)
+ * against one burst (see TBMS_BURST_READ). Prints one tab separated row per
+ * path: transactions, bytes on the wire, wire time at 615384 baud (10 bits
+ * per byte), latency with BENCH_TURNAROUND_US of module and host response
+ * per transaction, IO rounds (tbms_update calls a host needs at least) and
+ * CPU ns of the fastest read.
+ *
+ * Both paths run against the same emulated chain, straight through their
+ * tasks, while the library sleeps between sweeps. */
+
+#define BENCH_MODULES       16
+#define BENCH_REPEAT        1000
+#define BENCH_BAUD          615384
+#define BENCH_TURNAROUND_US 100
+
+static struct tbms     tb;
+static struct tbms_emu emu;
+
+struct bench_result {
+	const char *path;
+	unsigned transactions;
+	unsigned tx_bytes;
+	unsigned rx_bytes;
+	unsigned wire_us;
+	unsigned latency_us;
+	unsigned rounds;
+	double   cpu_ns;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Returns true if there was any bus traffic
+static bool bench_io(void)
+{
+	bool busy = false;
+
+	if (tbms_tx_available(&tb)) {
+		tbms_emu_flush(&emu);
+		tbms_emu_write(&emu, tbms_get_tx_buf(&tb), tbms_get_tx_len(&tb));
+		tbms_tx_flush(&tb);
+
+		busy = true;
+	}
+
+	if (tbms_rx_available(&tb)) {
+		size_t len;
+		uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+		tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+
+		busy = true;
+	}
+
+	return busy;
+}
+
+//Chain is discovered and library sleeps until next sweep
+static void bench_establish(void)
+{
+	tbms_emu_init(&emu, BENCH_MODULES);
+	tbms_init(&tb);
+
+	while (!tbms_is_ready(&tb) || tb.sleep == 0) {
+		bench_io();
+
+		tbms_emu_update(&emu, 1);
+		tbms_update(&tb, 1);
+	}
+}
+
+//Runs "task" on module "id" to completion, returns IO rounds it took
+static unsigned bench_task(enum tbms_task_event (*task)(struct tbms *,
+							 uint8_t),
+			   uint8_t id)
+{
+	unsigned rounds = 0;
+
+	while (task(&tb, id) == TBMS_TASK_EVENT_NONE)
+		rounds += bench_io();
+
+	return rounds;
+}
+
+static unsigned bench_path(enum tbms_task_event (*task[])(struct tbms *,
+							   uint8_t),
+			   uint8_t id)
+{
+	unsigned rounds = 0;
+
+	for (int i = 0; task[i]; i++)
+		rounds += bench_task(task[i], id);
+
+	return rounds;
+}
+
+void bench_run(const char *name,
+	       enum tbms_task_event (*task[])(struct tbms *, uint8_t),
+	       struct bench_result *res)
+{
+	uint32_t frames, tx_bytes, rx_bytes;
+	double best = 0;
+
+	bench_establish();
+
+	frames   = emu.frames;
+	tx_bytes = emu.tx_bytes;
+	rx_bytes = emu.rx_bytes;
+
+	res->path   = name;
+	res->rounds = bench_path(task, 0);
+
+	res->transactions = emu.frames - frames;
+	res->tx_bytes     = emu.tx_bytes - tx_bytes;
+	res->rx_bytes     = emu.rx_bytes - rx_bytes;
+	res->wire_us      = (unsigned)((res->tx_bytes + res->rx_bytes) *
+				       10 * 1000000ULL / BENCH_BAUD);
+	res->latency_us   = res->wire_us +
+			    res->transactions * BENCH_TURNAROUND_US;
+
+	//Least disturbed read (preemption, cache misses)
+	for (int i = 0; i < BENCH_REPEAT; i++) {
+		long long start = now_ns();
+
+		bench_path(task, (uint8_t)(i % BENCH_MODULES));
+
+		double ns = (double)(now_ns() - start);
+
+		if (!best || ns < best)
+			best = ns;
+	}
+
+	res->cpu_ns = best;
+}
+
+int main()
+{
+	static enum tbms_task_event (*two_reads[])(struct tbms *, uint8_t) = {
+		tbms_task_read_module_values, tbms_task_read_module_status,
+		NULL
+	};
+	static enum tbms_task_event (*burst[])(struct tbms *, uint8_t) = {
+		tbms_task_read_module_burst, NULL
+	};
+	struct bench_result res[2];
+
+	bench_run("two_reads", two_reads, &res[0]);
+	bench_run("burst", burst, &res[1]);
+
+	printf("#path\ttransactions\ttx_bytes\trx_bytes\twire_us\t"
+	       "latency_us\trounds\tcpu_ns\n");
+
+	for (int i = 0; i < 2; i++)
+		printf("%s\t%u\t%u\t%u\t%u\t%u\t%u\t%.1f\n", res[i].path,
+		       res[i].transactions, res[i].tx_bytes, res[i].rx_bytes,
+		       res[i].wire_us, res[i].latency_us, res[i].rounds,
+		       res[i].cpu_ns);
+
+	return 0;
+}
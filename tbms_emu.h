@@ -0,0 +1,449 @@
+#ifndef TBMS_EMU_H
+#define TBMS_EMU_H
+
+/* Virtual BQ76PL536 daisy chain. Takes bytes the library sends
+ * (tbms_emu_write) and produces the bytes the chain would answer with
+ * (tbms_emu_read). Models each module's register map, address assignment
+ * via ADDR_CTRL, broadcast reset, CRC, ADC conversion, COV/CUV faults and
+ * the balance timer. Errors (dropped or stray bytes, bad CRC, slow or missing
+ * replies) can be injected to test recovery.
+ *
+ * Wire format as seen on Tesla modules (see collin80_reference_output.txt):
+ * - writes are echoed unchanged (4 bytes with CRC),
+ * - reads are answered with request header, data and CRC,
+ * - frames answered by a module that has no address yet carry bit 7 set
+ *   (not covered by CRC),
+ * - requests to absent modules come back as they were sent. */
+
+#include "tesla_bms.h"
+
+#define TBMS_EMU_MAX_MODULES TBMS_MAX_MODULE_ADDR
+#define TBMS_EMU_REGS        0x40
+#define TBMS_EMU_OUT_BUF     (1 + 3 + TBMS_EMU_REGS + 1) //Noise, reply
+
+//Partially received request is dropped after this many ms
+#define TBMS_EMU_FRAME_TIMEOUT 10
+
+//Volts to raw cell ADC counts
+#define TBMS_EMU_RAW(v) ((uint16_t)((v) / TBMS_CELL_LSB + 0.5f))
+
+//Thermistor reading at 25C
+#define TBMS_EMU_TEMP_25C 4333
+
+//Register values after power on or broadcast reset
+#define TBMS_EMU_DEV_STATUS_RESET 0x61
+#define TBMS_EMU_FAULT_POR        0x08
+
+//Stray byte of TBMS_EMU_ERROR_NOISE
+#define TBMS_EMU_NOISE_BYTE 0xFF
+
+//FAULT_STATUS bits
+#define TBMS_EMU_FAULT_COV 0x01
+#define TBMS_EMU_FAULT_CUV 0x02
+#define TBMS_EMU_FAULT_CRC 0x04
+
+enum tbms_emu_error {
+	TBMS_EMU_ERROR_NONE,
+	TBMS_EMU_ERROR_DROP_BYTE, //Last byte of reply is lost
+	TBMS_EMU_ERROR_BAD_CRC,   //Last byte of reply is corrupted
+	TBMS_EMU_ERROR_SLOW,      //Reply comes "slow_delay" ms late
+	TBMS_EMU_ERROR_NO_REPLY,  //Request is lost
+	TBMS_EMU_ERROR_NOISE      //Stray byte precedes reply
+};
+
+struct tbms_emu_module {
+	uint8_t reg[TBMS_EMU_REGS]; //Address is reg[TBMS_REG_ADDR_CTRL] & 0x3F
+
+	//Analog inputs as raw ADC counts, sampled on conversion
+	uint16_t cell[TBMS_MODULE_CELLS];
+	uint16_t temp[2];
+
+	clock_t bal_timer; //ms until balancing stops, see TBMS_REG_BAL_TIME
+};
+
+struct tbms_emu {
+	struct tbms_emu_module module[TBMS_EMU_MAX_MODULES];
+	uint8_t count;
+
+	//COV/CUV thresholds (raw cell ADC counts)
+	uint16_t cov;
+	uint16_t cuv;
+
+	//Request being received
+	uint8_t req[TBMS_MAX_REQ_LEN];
+	size_t  req_len;
+	clock_t req_timer;
+
+	//Reply being sent, readable once "out_delay" ran out
+	uint8_t out[TBMS_EMU_OUT_BUF];
+	size_t  out_len;
+	size_t  out_pos;
+	clock_t out_delay;
+
+	//Applied to the next "error_count" replies
+	enum tbms_emu_error error;
+	uint16_t error_count;
+	clock_t  slow_delay;
+
+	//Traffic since tbms_emu_init
+	uint32_t frames;
+	uint32_t tx_bytes; //Library to chain
+	uint32_t rx_bytes; //Chain to library
+
+	clock_t time;
+};
+
+void tbms_emu_module_reset(struct tbms_emu_module *m)
+{
+	memset(m->reg, 0, sizeof(m->reg));
+
+	m->reg[TBMS_REG_DEV_STATUS]   = TBMS_EMU_DEV_STATUS_RESET;
+	m->reg[TBMS_REG_FAULT_STATUS] = TBMS_EMU_FAULT_POR;
+
+	m->bal_timer = 0;
+}
+
+//"modules" in chain, all cells at 3.7V and 25C
+void tbms_emu_init(struct tbms_emu *self, uint8_t modules)
+{
+	assert(modules <= TBMS_EMU_MAX_MODULES);
+
+	self->count = modules;
+
+	for (int i = 0; i < modules; i++) {
+		struct tbms_emu_module *m = &self->module[i];
+
+		tbms_emu_module_reset(m);
+
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			m->cell[j] = TBMS_EMU_RAW(3.7f);
+
+		m->temp[0] = TBMS_EMU_TEMP_25C;
+		m->temp[1] = TBMS_EMU_TEMP_25C;
+	}
+
+	self->cov = TBMS_EMU_RAW(4.2f);
+	self->cuv = TBMS_EMU_RAW(2.5f);
+
+	self->req_len   = 0;
+	self->req_timer = 0;
+
+	self->out_len   = 0;
+	self->out_pos   = 0;
+	self->out_delay = 0;
+
+	self->error       = TBMS_EMU_ERROR_NONE;
+	self->error_count = 0;
+	self->slow_delay  = 200;
+
+	self->frames   = 0;
+	self->tx_bytes = 0;
+	self->rx_bytes = 0;
+
+	self->time = 0;
+}
+
+//Applies "error" to the next "count" replies
+void tbms_emu_inject(struct tbms_emu *self, enum tbms_emu_error error,
+		    uint16_t count)
+{
+	self->error       = error;
+	self->error_count = count;
+}
+
+void tbms_emu_set_cell(struct tbms_emu *self, uint8_t id, uint8_t cn,
+		       float voltage)
+{
+	assert(id < self->count && cn < TBMS_MODULE_CELLS);
+
+	self->module[id].cell[cn] = TBMS_EMU_RAW(voltage);
+}
+
+//Module by its address (1..0x3E), first unaddressed one for 0, else NULL
+struct tbms_emu_module *tbms_emu_find(struct tbms_emu *self, uint8_t addr)
+{
+	for (int i = 0; i < self->count; i++)
+		if ((self->module[i].reg[TBMS_REG_ADDR_CTRL] & 0x3F) == addr)
+			return &self->module[i];
+
+	return NULL;
+}
+
+void tbms_emu_convert(struct tbms_emu *self, struct tbms_emu_module *m)
+{
+	uint8_t  ctrl = m->reg[TBMS_REG_ADC_CTRL];
+	uint8_t  cells = (ctrl & 0x07) + 1; //CELL_SEL
+	uint32_t sum = 0;
+	uint8_t  cov = 0, cuv = 0;
+
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++) {
+		uint16_t raw = i < cells ? m->cell[i] : 0;
+
+		m->reg[TBMS_REG_VCELL1 + i * 2]     = (uint8_t)(raw >> 8);
+		m->reg[TBMS_REG_VCELL1 + i * 2 + 1] = (uint8_t)raw;
+
+		sum += raw;
+
+		if (i >= cells)
+			continue;
+
+		if (raw > self->cov)
+			cov |= (uint8_t)(1 << i);
+		if (raw < self->cuv)
+			cuv |= (uint8_t)(1 << i);
+	}
+
+	//Module ADC LSB is 5.333 (16 / 3) times cell ADC LSB
+	if (ctrl & 0x08) { //GPAI
+		uint16_t raw = (uint16_t)(sum * 3 / 16);
+
+		m->reg[TBMS_REG_GPAI]     = (uint8_t)(raw >> 8);
+		m->reg[TBMS_REG_GPAI + 1] = (uint8_t)raw;
+	}
+
+	//TS1, TS2 need their VSS pins enabled in IO_CTRL
+	for (int i = 0; i < 2; i++) {
+		uint16_t raw = 0;
+
+		if ((ctrl & (0x10 << i)) && (m->reg[TBMS_REG_IO_CTRL] & (1 << i)))
+			raw = m->temp[i];
+
+		m->reg[TBMS_REG_TEMPERATURE1 + i * 2]     = (uint8_t)(raw >> 8);
+		m->reg[TBMS_REG_TEMPERATURE1 + i * 2 + 1] = (uint8_t)raw;
+	}
+
+	//Faults latch until cleared through FAULT_STATUS
+	m->reg[TBMS_REG_COV_FAULT] |= cov;
+	m->reg[TBMS_REG_CUV_FAULT] |= cuv;
+
+	if (m->reg[TBMS_REG_COV_FAULT])
+		m->reg[TBMS_REG_FAULT_STATUS] |= TBMS_EMU_FAULT_COV;
+	if (m->reg[TBMS_REG_CUV_FAULT])
+		m->reg[TBMS_REG_FAULT_STATUS] |= TBMS_EMU_FAULT_CUV;
+
+	m->reg[TBMS_REG_DEV_STATUS] |= 0x01; //DRDY
+}
+
+void tbms_emu_module_write(struct tbms_emu *self, struct tbms_emu_module *m,
+			   uint8_t reg, uint8_t val)
+{
+	switch (reg) {
+	case TBMS_REG_ALERT_STATUS:
+		m->reg[reg] &= (uint8_t)~val; //Ones clear latched bits
+		break;
+
+	case TBMS_REG_FAULT_STATUS:
+		m->reg[reg] &= (uint8_t)~val;
+
+		if (val & TBMS_EMU_FAULT_COV)
+			m->reg[TBMS_REG_COV_FAULT] = 0;
+		if (val & TBMS_EMU_FAULT_CUV)
+			m->reg[TBMS_REG_CUV_FAULT] = 0;
+		break;
+
+	case TBMS_REG_ADC_CTRL:
+	case TBMS_REG_IO_CTRL:
+	case TBMS_REG_BAL_TIME:
+		m->reg[reg] = val;
+		break;
+
+	case TBMS_REG_BAL_CTRL:
+		m->reg[reg] = val & 0x3F;
+
+		//BAL_TIME bit 7 selects minutes instead of seconds
+		m->bal_timer = (m->reg[TBMS_REG_BAL_TIME] & 0x7F) * 1000L;
+		if (m->reg[TBMS_REG_BAL_TIME] & 0x80)
+			m->bal_timer *= 60;
+		break;
+
+	case TBMS_REG_ADC_CONV:
+		if (val & 0x01)
+			tbms_emu_convert(self, m);
+		break;
+
+	case TBMS_REG_ADDR_CTRL:
+		m->reg[reg] = val;
+		break;
+
+	case TBMS_REG_RESET:
+		if (val == 0xA5)
+			tbms_emu_module_reset(m);
+		break;
+	}
+}
+
+//Drops reply bytes that were not read yet (like UART RX flush)
+void tbms_emu_flush(struct tbms_emu *self)
+{
+	self->out_len = 0;
+	self->out_pos = 0;
+}
+
+void tbms_emu_reply(struct tbms_emu *self, const uint8_t *data, size_t len)
+{
+	//Nobody read previous replies, they are lost
+	if (self->out_len + len > sizeof(self->out))
+		tbms_emu_flush(self);
+
+	memcpy(&self->out[self->out_len], data, len);
+	self->out_len += len;
+}
+
+//Complete request in "req"
+void tbms_emu_request(struct tbms_emu *self)
+{
+	uint8_t *req = self->req;
+	uint8_t addr = req[0] >> 1;
+	uint8_t out[TBMS_EMU_OUT_BUF];
+	size_t  len;
+	struct tbms_emu_module *m = NULL;
+
+	self->frames++;
+
+	if (self->error_count && self->error == TBMS_EMU_ERROR_NO_REPLY) {
+		self->error_count--;
+		return;
+	}
+
+	if (addr != (TBMS_BROADCAST >> 1))
+		m = tbms_emu_find(self, addr);
+
+	if (req[0] & TBMS_WRITE) {
+		memcpy(out, req, 4);
+		len = 4;
+
+		if (tbms_gen_crc(req, 3) != req[3]) {
+			//Frame is ignored, addressed module notes it
+			if (m)
+				m->reg[TBMS_REG_FAULT_STATUS] |=
+					TBMS_EMU_FAULT_CRC;
+		} else if (addr == (TBMS_BROADCAST >> 1)) {
+			for (int i = 0; i < self->count; i++)
+				tbms_emu_module_write(self, &self->module[i],
+						      req[1], req[2]);
+		} else if (m) {
+			tbms_emu_module_write(self, m, req[1], req[2]);
+		}
+
+		if (m && !addr)
+			out[0] |= 0x80;
+	} else if (m) {
+		uint8_t n = req[2];
+
+		if (req[1] + n > TBMS_EMU_REGS)
+			n = (uint8_t)(TBMS_EMU_REGS - req[1]);
+
+		out[0] = req[0];
+		out[1] = req[1];
+		out[2] = n;
+		memcpy(&out[3], &m->reg[req[1]], n);
+
+		//Bit 7 is not covered by CRC
+		len = 3 + n;
+		out[len] = tbms_gen_crc(out, len);
+		len++;
+
+		if (!addr)
+			out[0] |= 0x80;
+	} else {
+		//Nobody answers, request comes back as it was sent
+		memcpy(out, req, 3);
+		len = 3;
+	}
+
+	if (self->error_count) {
+		switch (self->error) {
+		case TBMS_EMU_ERROR_DROP_BYTE:
+			len--;
+			break;
+
+		case TBMS_EMU_ERROR_BAD_CRC:
+			out[len - 1] ^= 0x5A;
+			break;
+
+		case TBMS_EMU_ERROR_SLOW:
+			self->out_delay = self->slow_delay;
+			break;
+
+		case TBMS_EMU_ERROR_NOISE:
+			memmove(&out[1], out, len);
+			out[0] = TBMS_EMU_NOISE_BYTE;
+			len++;
+			break;
+
+		default:
+			break;
+		}
+
+		self->error_count--;
+	}
+
+	tbms_emu_reply(self, out, len);
+}
+
+//Bytes sent by library
+void tbms_emu_write(struct tbms_emu *self, const uint8_t *data, size_t len)
+{
+	self->tx_bytes += (uint32_t)len;
+
+	for (size_t i = 0; i < len; i++) {
+		self->req[self->req_len++] = data[i];
+		self->req_timer = 0;
+
+		//Writes carry value and CRC, reads only length
+		if (self->req_len < 3 ||
+		    (self->req_len == 3 && (self->req[0] & TBMS_WRITE)))
+			continue;
+
+		tbms_emu_request(self);
+		self->req_len = 0;
+	}
+}
+
+//Reply bytes that already arrived, up to "len". Returns their count.
+size_t tbms_emu_read(struct tbms_emu *self, uint8_t *data, size_t len)
+{
+	size_t n = self->out_len - self->out_pos;
+
+	if (self->out_delay)
+		return 0;
+
+	if (n > len)
+		n = len;
+
+	memcpy(data, &self->out[self->out_pos], n);
+	self->out_pos += n;
+
+	if (self->out_pos >= self->out_len)
+		tbms_emu_flush(self);
+
+	self->rx_bytes += (uint32_t)n;
+
+	return n;
+}
+
+//Advances emulated time
+void tbms_emu_update(struct tbms_emu *self, clock_t delta)
+{
+	self->time += delta;
+
+	if (self->req_len && (self->req_timer += delta) >=
+	    TBMS_EMU_FRAME_TIMEOUT)
+		self->req_len = 0;
+
+	self->out_delay = self->out_delay > delta ? self->out_delay - delta : 0;
+
+	for (int i = 0; i < self->count; i++) {
+		struct tbms_emu_module *m = &self->module[i];
+
+		if (!m->bal_timer)
+			continue;
+
+		m->bal_timer = m->bal_timer > delta ? m->bal_timer - delta : 0;
+
+		if (!m->bal_timer)
+			m->reg[TBMS_REG_BAL_CTRL] = 0;
+	}
+}
+
+#endif //TBMS_EMU_H
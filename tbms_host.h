@@ -0,0 +1,260 @@
+#ifndef TBMS_HOST_H
+#define TBMS_HOST_H
+
+/* Linux host runtime. Drives several battery strings (buses), each with its
+ * own "struct tbms" and serial port, from a single epoll loop. Buses share
+ * nothing, so a slow or dead bus does not delay the others.
+ *
+ * Serial ports are handled by tbms_serial.h, bytes go straight between tty
+ * and library buffers. Compile with -std=gnu99 (or define _DEFAULT_SOURCE). */
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "tesla_bms.h"
+#include "tbms_serial.h"
+
+#ifndef TBMS_HOST_MAX_BUSES
+#define TBMS_HOST_MAX_BUSES 8
+#endif
+
+//Longest sleep (ms), buses ask for less (see tbms_next_deadline)
+#define TBMS_HOST_MAX_SLEEP 1000
+
+//Limit of TX/RX rounds per bus and wakeup, so noise can not starve others
+#define TBMS_HOST_MAX_STEPS 16
+
+struct tbms_host_bus {
+	struct tbms tb;
+
+	struct tbms_serial port; //fd is -1 after hangup or error
+
+	clock_t last; //Time of last tbms_update (see tbms_host_now)
+
+	bool wait_out; //EPOLLOUT is registered, port was full
+};
+
+struct tbms_host {
+	int epfd;
+
+	struct tbms_host_bus bus[TBMS_HOST_MAX_BUSES];
+	uint8_t count;
+};
+
+//Monotonic milliseconds
+clock_t tbms_host_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (clock_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//Returns 0 on success, -1 and errno on error
+int tbms_host_init(struct tbms_host *self)
+{
+	self->count = 0;
+	self->epfd  = epoll_create1(EPOLL_CLOEXEC);
+
+	return self->epfd < 0 ? -1 : 0;
+}
+
+/* Closes epoll descriptor and all bus descriptors */
+void tbms_host_close(struct tbms_host *self)
+{
+	for (int i = 0; i < self->count; i++)
+		tbms_serial_close(&self->bus[i].port);
+
+	if (self->epfd >= 0)
+		close(self->epfd);
+
+	self->epfd = -1;
+}
+
+/* Opens serial port "path" (see tbms_serial_open) as a new bus.
+ * Returns bus index or -1 and errno on error. */
+int tbms_host_open(struct tbms_host *self, const char *path)
+{
+	struct tbms_host_bus *b;
+	struct epoll_event ev;
+
+	if (self->count >= TBMS_HOST_MAX_BUSES) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	b = &self->bus[self->count];
+
+	if (tbms_serial_open(&b->port, path) < 0)
+		return -1;
+
+	//Edge triggered, bytes may wait in tty until library wants them
+	ev.events   = EPOLLIN | EPOLLET;
+	ev.data.u32 = self->count;
+
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, b->port.fd, &ev) < 0) {
+		int err = errno;
+
+		tbms_serial_close(&b->port);
+
+		errno = err;
+		return -1;
+	}
+
+	tbms_init(&b->tb);
+
+	b->last = tbms_host_now();
+	b->wait_out = false;
+
+	return self->count++;
+}
+
+struct tbms *tbms_host_get(struct tbms_host *self, uint8_t bus)
+{
+	assert(bus < self->count);
+
+	return &self->bus[bus].tb;
+}
+
+/* Bus is not usable anymore. Its library instance is disconnected (see
+ * tbms_disconnect) and not updated from now on, so tbms_is_ready stays
+ * false. */
+void tbms_host_bus_hangup(struct tbms_host *self, struct tbms_host_bus *b)
+{
+	if (b->port.fd < 0)
+		return;
+
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, b->port.fd, NULL);
+	tbms_serial_close(&b->port);
+
+	tbms_disconnect(&b->tb);
+}
+
+/* EPOLLOUT is only watched while port is full, a writable tty would wake
+ * host after every frame otherwise. */
+void tbms_host_bus_watch(struct tbms_host *self, struct tbms_host_bus *b)
+{
+	struct epoll_event ev;
+	bool out = !b->port.writable;
+
+	if (b->port.fd < 0 || out == b->wait_out)
+		return;
+
+	ev.events   = EPOLLIN | EPOLLET | (out ? EPOLLOUT : 0);
+	ev.data.u32 = (uint32_t)(b - self->bus);
+
+	if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, b->port.fd, &ev) < 0)
+		tbms_host_bus_hangup(self, b);
+	else
+		b->wait_out = out;
+}
+
+void tbms_host_bus_update(struct tbms_host *self, struct tbms_host_bus *b,
+			  clock_t now)
+{
+	clock_t delta = now - b->last;
+
+	b->last = now;
+
+	//Hung up, nothing can be sent or received anymore
+	if (b->port.fd < 0)
+		return;
+
+	//Replies are processed in the same wakeup they arrive in
+	for (int i = 0; i < TBMS_HOST_MAX_STEPS; i++) {
+		int progress;
+
+		tbms_update(&b->tb, delta);
+		delta = 0;
+
+		if (tbms_tx_available(&b->tb))
+			progress = tbms_serial_tx(&b->port, &b->tb);
+		else
+			progress = (int)tbms_serial_rx(&b->port, &b->tb);
+
+		if (progress < 0)
+			tbms_host_bus_hangup(self, b);
+
+		if (progress <= 0)
+			break;
+	}
+
+	tbms_host_bus_watch(self, b);
+}
+
+//Milliseconds until any bus needs an update, unless its input arrives first
+int tbms_host_timeout(struct tbms_host *self)
+{
+	clock_t now = tbms_host_now();
+	clock_t timeout = TBMS_HOST_MAX_SLEEP;
+
+	for (int i = 0; i < self->count; i++) {
+		struct tbms_host_bus *b = &self->bus[i];
+		clock_t deadline;
+
+		//Hung up, never updated again
+		if (b->port.fd < 0)
+			continue;
+
+		//Input left in tty (step limit) gives no new edge
+		if (b->port.readable && tbms_rx_available(&b->tb))
+			return 0;
+
+		//Frame to send, unless port is full (EPOLLOUT wakes host)
+		if (b->port.writable && tbms_tx_available(&b->tb))
+			return 0;
+
+		deadline = tbms_next_deadline(&b->tb) - (now - b->last);
+
+		if (deadline < timeout)
+			timeout = deadline;
+	}
+
+	return timeout > 0 ? (int)timeout : 0;
+}
+
+/* Sleeps until any bus has input or a deadline (see tbms_host_timeout),
+ * then updates all of them. Returns 0, or -1 and errno if epoll fails. */
+int tbms_host_run(struct tbms_host *self)
+{
+	struct epoll_event ev[TBMS_HOST_MAX_BUSES];
+	clock_t now;
+	int n;
+
+	n = epoll_wait(self->epfd, ev, TBMS_HOST_MAX_BUSES,
+		       tbms_host_timeout(self));
+
+	if (n < 0) {
+		if (errno != EINTR)
+			return -1;
+
+		n = 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct tbms_host_bus *b = &self->bus[ev[i].data.u32];
+
+		if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+			tbms_host_bus_hangup(self, b);
+			continue;
+		}
+
+		if (ev[i].events & EPOLLIN)
+			b->port.readable = true;
+
+		if (ev[i].events & EPOLLOUT)
+			b->port.writable = true;
+	}
+
+	now = tbms_host_now();
+
+	for (int i = 0; i < self->count; i++)
+		tbms_host_bus_update(self, &self->bus[i], now);
+
+	return 0;
+}
+
+#endif //TBMS_HOST_H
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE //posix_openpt
+
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "tbms_host.h"
+#include "tbms_emu.h"
+
+/* Each bus is a pseudo-terminal pair. Host opens the slave side as serial
+ * port (tbms_serial.h), the master side is answered by emulated modules in
+ * a child process, so host may sleep as long as it wants. */
+
+#define BUSES 4
+#define DEAD_BUS (BUSES - 1) //Never answers
+
+//Once ready, host must sleep between requests instead of ticking each ms
+#define IDLE_TIME        2000
+#define IDLE_MAX_WAKEUPS 200
+
+//Time host keeps running after chain hung up, dead bus must not wake it
+#define HANGUP_TIME        500
+#define HANGUP_MAX_WAKEUPS 10
+
+/* Buses are independent, bus 0 must get ready as fast alongside the others
+ * (dead bus timing out included) as alone, give or take this many ms */
+#define READY_TOLERANCE  50
+
+struct fake_chain {
+	int fd;
+	bool dead;
+
+	struct tbms_emu emu;
+	clock_t last;
+};
+
+void fake_chain_update(struct fake_chain *c)
+{
+	uint8_t buf[TBMS_EMU_OUT_BUF];
+	ssize_t len;
+	size_t n;
+	clock_t now = tbms_host_now();
+
+	while ((len = read(c->fd, buf, sizeof(buf))) > 0)
+		if (!c->dead)
+			tbms_emu_write(&c->emu, buf, (size_t)len);
+
+	tbms_emu_update(&c->emu, now - c->last);
+	c->last = now;
+
+	while ((n = tbms_emu_read(&c->emu, buf, sizeof(buf))) > 0)
+		if (write(c->fd, buf, n) != (ssize_t)n)
+			perror("fake chain write");
+}
+
+//Answers "count" buses until parent exits
+void fake_chains_run(struct fake_chain *chain, int count, pid_t parent)
+{
+	struct pollfd pfd[BUSES];
+
+	for (int i = 0; i < count; i++) {
+		pfd[i].fd     = chain[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	while (getppid() == parent) {
+		poll(pfd, (nfds_t)count, 1);
+
+		for (int i = 0; i < count; i++)
+			fake_chain_update(&chain[i]);
+	}
+
+	exit(0);
+}
+
+//Returns path of slave side, master side goes to "master"
+const char *open_pty(int *master)
+{
+	*master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+	if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0)
+		return NULL;
+
+	return ptsname(*master);
+}
+
+//Time (ms) bus 0 takes to get ready when it is the only bus, -1 on error
+long ready_alone(void)
+{
+	struct tbms_host host;
+	struct fake_chain chain;
+	clock_t start;
+	long ready = -1;
+	pid_t child;
+
+	if (tbms_host_init(&host) < 0)
+		return -1;
+
+	const char *slave = open_pty(&chain.fd);
+
+	if (!slave || tbms_host_open(&host, slave) != 0) {
+		tbms_host_close(&host);
+		return -1;
+	}
+
+	chain.dead = false;
+	chain.last = tbms_host_now();
+	tbms_emu_init(&chain.emu, 1);
+
+	child = fork();
+
+	if (child < 0) {
+		tbms_host_close(&host);
+		close(chain.fd);
+		return -1;
+	}
+
+	if (!child)
+		fake_chains_run(&chain, 1, getppid());
+
+	start = tbms_host_now();
+
+	while (tbms_host_now() - start < 5000 && tbms_host_run(&host) >= 0) {
+		if (tbms_is_ready(tbms_host_get(&host, 0))) {
+			ready = (long)(tbms_host_now() - start);
+			break;
+		}
+	}
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+
+	tbms_host_close(&host);
+	close(chain.fd);
+
+	return ready;
+}
+
+/* Master side of a ready bus is closed (cable pulled), bus must not report
+ * data from before hangup as valid. Returns number of failures. */
+int hangup(void)
+{
+	struct tbms_host host;
+	struct fake_chain chain;
+	clock_t start;
+	bool ready = false;
+	unsigned wakeups = 0;
+	int failed = 0;
+	pid_t child;
+
+	if (tbms_host_init(&host) < 0)
+		return 1;
+
+	const char *slave = open_pty(&chain.fd);
+
+	if (!slave || tbms_host_open(&host, slave) != 0) {
+		tbms_host_close(&host);
+		return 1;
+	}
+
+	chain.dead = false;
+	chain.last = tbms_host_now();
+	tbms_emu_init(&chain.emu, 1);
+
+	child = fork();
+
+	if (child < 0) {
+		tbms_host_close(&host);
+		close(chain.fd);
+		return 1;
+	}
+
+	if (!child)
+		fake_chains_run(&chain, 1, getppid());
+
+	start = tbms_host_now();
+
+	while (!ready && tbms_host_now() - start < 5000 &&
+	       tbms_host_run(&host) >= 0)
+		ready = tbms_is_ready(tbms_host_get(&host, 0));
+
+	//Child holds master side as well
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	close(chain.fd);
+
+	for (clock_t t = tbms_host_now(); ready &&
+	     tbms_host_now() - t < HANGUP_TIME; wakeups++) {
+		if (tbms_host_run(&host) < 0) {
+			perror("tbms_host_run");
+			failed++;
+			break;
+		}
+	}
+
+	bool ok = ready && host.bus[0].port.fd < 0 &&
+		  !tbms_is_ready(tbms_host_get(&host, 0)) &&
+		  !tbms_has_faults(tbms_host_get(&host, 0));
+
+	printf("hangup: was ready %s, closed %s, ready %s, %s\n",
+	       ready ? "yes" : "no", host.bus[0].port.fd < 0 ? "yes" : "no",
+	       tbms_is_ready(tbms_host_get(&host, 0)) ? "yes" : "no",
+	       ok ? "OK" : "FAIL");
+	failed += !ok;
+
+	printf("hangup: %u wakeups in %i ms, %s\n", wakeups, HANGUP_TIME,
+	       wakeups <= HANGUP_MAX_WAKEUPS ? "OK" : "FAIL");
+	failed += wakeups > HANGUP_MAX_WAKEUPS;
+
+	tbms_host_close(&host);
+
+	return failed;
+}
+
+/* Frame that can not be sent (port full or gone) must not make host spin,
+ * it has a deadline and times out like a missing reply. Returns number of
+ * failures. */
+int unsent(void)
+{
+	struct tbms tb;
+	clock_t deadline;
+	bool ok;
+
+	tbms_init(&tb);
+
+	for (int i = 0; i < 2000 && !tbms_tx_available(&tb); i++)
+		tbms_update(&tb, 1);
+
+	deadline = tbms_next_deadline(&tb);
+
+	if (tbms_tx_available(&tb))
+		tbms_update(&tb, deadline);
+
+	ok = deadline > 0 && tb.io.state == TBMS_IO_STATE_TIMEOUT;
+
+	printf("unsent: deadline %li ms, timed out %s, %s\n", (long)deadline,
+	       tb.io.state == TBMS_IO_STATE_TIMEOUT ? "yes" : "no",
+	       ok ? "OK" : "FAIL");
+
+	return !ok;
+}
+
+int main()
+{
+	struct tbms_host host;
+	struct fake_chain chain[BUSES];
+	clock_t ready_at[BUSES] = { 0 };
+	clock_t start;
+	bool all_ready = false;
+	unsigned wakeups = 0;
+	int failed = 0;
+	pid_t child;
+	long alone = ready_alone();
+
+	if (alone < 0) {
+		perror("bus alone");
+		return 1;
+	}
+
+	if (tbms_host_init(&host) < 0) {
+		perror("tbms_host_init");
+		return 1;
+	}
+
+	for (int i = 0; i < BUSES; i++) {
+		const char *slave = open_pty(&chain[i].fd);
+		struct termios2 tio;
+
+		if (!slave || tbms_host_open(&host, slave) != i) {
+			perror("pty");
+			return 1;
+		}
+
+		if (ioctl(host.bus[i].port.fd, TCGETS2, &tio) < 0 ||
+		    tio.c_ospeed != TBMS_SERIAL_BAUD) {
+			printf("bus %i: baud rate not set, FAIL\n", i);
+			failed++;
+		}
+
+		chain[i].dead = i == DEAD_BUS;
+		chain[i].last = tbms_host_now();
+		tbms_emu_init(&chain[i].emu, (uint8_t)(i + 1));
+	}
+
+	child = fork();
+
+	if (child < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	if (!child)
+		fake_chains_run(chain, BUSES, getppid());
+
+	start = tbms_host_now();
+
+	while (!all_ready && tbms_host_now() - start < 5000) {
+		if (tbms_host_run(&host) < 0) {
+			perror("tbms_host_run");
+			return 1;
+		}
+
+		all_ready = true;
+
+		for (int i = 0; i < BUSES; i++) {
+			if (i == DEAD_BUS)
+				continue;
+
+			if (!ready_at[i] && tbms_is_ready(tbms_host_get(&host, i)))
+				ready_at[i] = tbms_host_now();
+
+			all_ready = all_ready && ready_at[i];
+		}
+	}
+
+	for (int i = 0; i < BUSES; i++) {
+		struct tbms *tb = tbms_host_get(&host, i);
+		bool ok = i == DEAD_BUS ? !tbms_is_ready(tb) :
+			  tbms_is_ready(tb) &&
+			  tb->modules_count == chain[i].emu.count;
+
+		printf("bus %i: modules %i ready %s, %s\n", i,
+		       tb->modules_count, tbms_is_ready(tb) ? "yes" : "no",
+		       ok ? "OK" : "FAIL");
+
+		//Init waits 1s, one sweep over few modules should take ~ms
+		if (i != DEAD_BUS)
+			fprintf(stderr, "bus %i ready after %li ms\n", i,
+				(long)(ready_at[i] - start));
+
+		failed += !ok;
+	}
+
+	//Bus 0 has the same chain as alone, other buses must not delay it
+	long shared = ready_at[0] ? (long)(ready_at[0] - start) : -1;
+	bool scales = shared >= 0 && labs(shared - alone) <= READY_TOLERANCE;
+
+	printf("bus 0: ready after %li ms alone, %li ms with %i buses, %s\n",
+	       alone, shared, BUSES, scales ? "OK" : "FAIL");
+	failed += !scales;
+
+	//Steady state, dead bus keeps timing out and starting over
+	for (clock_t t = tbms_host_now(); all_ready &&
+	     tbms_host_now() - t < IDLE_TIME; wakeups++) {
+		if (tbms_host_run(&host) < 0) {
+			perror("tbms_host_run");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < BUSES; i++) {
+		bool ok = tbms_is_ready(tbms_host_get(&host, i)) != (i == DEAD_BUS);
+
+		printf("bus %i: still %s, %s\n", i, ok == (i != DEAD_BUS) ?
+		       "ready" : "not ready", ok ? "OK" : "FAIL");
+		failed += !ok;
+	}
+
+	printf("%u wakeups in %i ms, %s\n", wakeups, IDLE_TIME,
+	       wakeups <= IDLE_MAX_WAKEUPS ? "OK" : "FAIL");
+	failed += wakeups > IDLE_MAX_WAKEUPS;
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+
+	tbms_host_close(&host);
+
+	for (int i = 0; i < BUSES; i++)
+		close(chain[i].fd);
+
+	failed += hangup();
+	failed += unsent();
+
+	return failed ? 1 : 0;
+}
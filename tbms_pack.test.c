@@ -0,0 +1,247 @@
+#include "tesla_bms.h"
+
+/* Pack aggregates (tbms_pack_update) against a brute force scan of all
+ * module values. Values of a module are stored the way a read does, then
+ * every tbms_get_pack_* result must match the scan: extremes by value, and
+ * the module (and cell) they are reported at must hold that value. */
+
+#define MODULES 4
+#define RANDOM_UPDATES 20000
+
+#define RAW_INVALID 0xFFFF //Above TBMS_TEMP_RAW_MAX
+
+static struct tbms tb;
+
+static uint16_t cell_raw[MODULES][TBMS_MODULE_CELLS];
+static uint16_t temp_raw[MODULES][2];
+
+//Stores values of module "id" and updates pack like a read does
+void module_update(uint8_t id)
+{
+	struct tbms_modules *m = &tb.modules;
+	uint32_t cell_sum = 0;
+
+	for (int j = 0; j < TBMS_MODULE_CELLS; j++) {
+		m->cell[id][j] = TBMS_CELL_VOLT(cell_raw[id][j]);
+		cell_sum += cell_raw[id][j];
+	}
+
+	m->temp[id][0] = TBMS_TEMP(temp_raw[id][0]);
+	m->temp[id][1] = TBMS_TEMP(temp_raw[id][1]);
+
+	tbms_pack_update(&tb, id, cell_sum);
+}
+
+bool same(float a, float b)
+{
+	return a == b || (isnan(a) && isnan(b));
+}
+
+//Returns true if every pack getter matches a brute force scan
+bool pack_check(void)
+{
+	struct tbms_modules *m = &tb.modules;
+	float cell_min = NAN, cell_max = NAN, temp_min = NAN, temp_max = NAN;
+	uint32_t sum = 0;
+	uint8_t id, cn;
+	bool ok = true;
+
+	for (int i = 0; i < MODULES; i++) {
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++) {
+			float v = TBMS_CELL_TO_F(m->cell[i][j]);
+
+			if (isnan(cell_min) || v < cell_min)
+				cell_min = v;
+			if (isnan(cell_max) || v > cell_max)
+				cell_max = v;
+
+			sum += cell_raw[i][j];
+		}
+
+		for (int j = 0; j < 2; j++) {
+			float t = TBMS_TEMP_TO_F(m->temp[i][j]);
+
+			if (isnan(t))
+				continue;
+
+			if (isnan(temp_min) || t < temp_min)
+				temp_min = t;
+			if (isnan(temp_max) || t > temp_max)
+				temp_max = t;
+		}
+	}
+
+	ok = ok && tbms_get_pack_voltage(&tb) == sum * TBMS_CELL_LSB;
+
+	ok = ok && same(tbms_get_pack_cell_min(&tb, &id, &cn), cell_min) &&
+	     TBMS_CELL_TO_F(m->cell[id][cn]) == cell_min;
+	ok = ok && same(tbms_get_pack_cell_max(&tb, &id, &cn), cell_max) &&
+	     TBMS_CELL_TO_F(m->cell[id][cn]) == cell_max;
+	ok = ok && same(tbms_get_pack_cell_delta(&tb), cell_max - cell_min);
+
+	id = TBMS_PACK_NONE;
+	ok = ok && same(tbms_get_pack_temp_min(&tb, &id), temp_min) &&
+	     (isnan(temp_min) ?
+	      id == TBMS_PACK_NONE :
+	      (TBMS_TEMP_TO_F(m->temp[id][0]) == temp_min ||
+	       TBMS_TEMP_TO_F(m->temp[id][1]) == temp_min));
+
+	id = TBMS_PACK_NONE;
+	ok = ok && same(tbms_get_pack_temp_max(&tb, &id), temp_max) &&
+	     (isnan(temp_max) ?
+	      id == TBMS_PACK_NONE :
+	      (TBMS_TEMP_TO_F(m->temp[id][0]) == temp_max ||
+	       TBMS_TEMP_TO_F(m->temp[id][1]) == temp_max));
+
+	return ok;
+}
+
+int step(const char *name)
+{
+	bool ok = pack_check();
+
+	printf("%s: %s\n", name, ok ? "OK" : "FAIL");
+
+	return !ok;
+}
+
+//Extreme cells of module "id" move, others stay
+int test_cells(uint8_t id)
+{
+	int failed = 0;
+
+	//Module holds pack minimum at cell 2 and maximum at cell 4
+	cell_raw[id][2] = 8000;
+	cell_raw[id][4] = 11500;
+	module_update(id);
+	failed += step("cell extremes set");
+
+	cell_raw[id][2] = 9800;
+	module_update(id);
+	failed += step("cell min moves inwards");
+
+	cell_raw[id][2] = 7000;
+	module_update(id);
+	failed += step("cell min moves outwards");
+
+	cell_raw[id][4] = 10100;
+	module_update(id);
+	failed += step("cell max moves inwards");
+
+	cell_raw[id][4] = 12000;
+	module_update(id);
+	failed += step("cell max moves outwards");
+
+	//Both extremes leave this module at once
+	cell_raw[id][2] = 9900;
+	cell_raw[id][4] = 10000;
+	module_update(id);
+	failed += step("cell min and max move inwards");
+
+	return failed;
+}
+
+//Extreme temperatures of module "id" move and become invalid
+int test_temps(uint8_t id)
+{
+	int failed = 0;
+
+	//Higher raw value is higher temperature
+	temp_raw[id][0] = 3000;
+	temp_raw[id][1] = 6000;
+	module_update(id);
+	failed += step("temp extremes set");
+
+	temp_raw[id][0] = 4300;
+	module_update(id);
+	failed += step("temp min moves inwards");
+
+	temp_raw[id][0] = 2500;
+	module_update(id);
+	failed += step("temp min moves outwards");
+
+	temp_raw[id][1] = 4400;
+	module_update(id);
+	failed += step("temp max moves inwards");
+
+	temp_raw[id][1] = 7000;
+	module_update(id);
+	failed += step("temp max moves outwards");
+
+	temp_raw[id][0] = RAW_INVALID;
+	module_update(id);
+	failed += step("temp min becomes invalid");
+
+	temp_raw[id][1] = RAW_INVALID;
+	module_update(id);
+	failed += step("temp max becomes invalid");
+
+	//No valid temperature left in the pack
+	for (uint8_t i = 0; i < MODULES; i++) {
+		temp_raw[i][0] = temp_raw[i][1] = RAW_INVALID;
+		module_update(i);
+	}
+	failed += step("all temps invalid");
+
+	temp_raw[id][1] = 4333;
+	module_update(id);
+	failed += step("temp valid again");
+
+	return failed;
+}
+
+//Random values from a narrow range, so extremes move and tie a lot
+int test_random(void)
+{
+	uint32_t seed = 1;
+	unsigned bad = 0;
+
+	for (int n = 0; n < RANDOM_UPDATES; n++) {
+		uint8_t id = (uint8_t)(n % MODULES);
+
+		for (int j = 0; j < TBMS_MODULE_CELLS + 2; j++) {
+			seed = seed * 1103515245 + 12345;
+
+			uint16_t r = (uint16_t)((seed >> 16) % 64);
+
+			if (j < TBMS_MODULE_CELLS)
+				cell_raw[id][j] = 9700 + r;
+			else
+				temp_raw[id][j - TBMS_MODULE_CELLS] =
+					r < 4 ? RAW_INVALID : 4300 + r;
+		}
+
+		module_update(id);
+		bad += !pack_check();
+	}
+
+	printf("%i random updates: %u wrong, %s\n", RANDOM_UPDATES, bad,
+	       bad ? "FAIL" : "OK");
+
+	return bad != 0;
+}
+
+int main()
+{
+	int failed = 0;
+
+	tbms_init(&tb);
+
+	//Distinct values, so every extreme has a single place
+	for (uint8_t i = 0; i < MODULES; i++) {
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			cell_raw[i][j] = (uint16_t)(9700 + i * 50 + j * 7);
+
+		temp_raw[i][0] = (uint16_t)(4000 + i * 40);
+		temp_raw[i][1] = (uint16_t)(4010 + i * 40);
+
+		module_update(i);
+	}
+	failed += step("all modules read");
+
+	failed += test_cells(1);
+	failed += test_temps(2);
+	failed += test_random();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#ifndef TBMS_SERIAL_H
+#define TBMS_SERIAL_H
+
+/* Linux serial backend. Opens tty at 615384 baud 8N1 (termios2, arbitrary
+ * baud rate), reads straight into library IO buffer (tbms_get_rx_buf) and
+ * writes straight from it (tbms_get_tx_buf), without intermediate copies.
+ *
+ * Descriptor is non-blocking, meant for edge triggered epoll (see
+ * tbms_host.h): set "readable" when EPOLLIN fires, it is cleared once tty
+ * input is drained. Same for "writable" and EPOLLOUT, cleared once tty
+ * output is full. Can not be used together with <termios.h>. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "tesla_bms.h"
+
+#define TBMS_SERIAL_BAUD 615384
+
+struct tbms_serial {
+	int fd;
+
+	size_t tx_pos;  //Bytes of current TX frame already written
+	bool readable;  //Input may be waiting
+	bool writable;  //Output may be accepted
+};
+
+/* Raw 8N1 at "baud", reads return whatever is there (VMIN 1 + O_NONBLOCK
+ * gives EAGAIN when empty). Returns 0, or -1 and errno. */
+int tbms_serial_config(int fd, speed_t baud)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+
+	tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+			 ICRNL | IXON | IXOFF | IXANY);
+	tio.c_oflag &= ~OPOST;
+	tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	tio.c_cflag &= ~(CBAUD | CSIZE | PARENB | CSTOPB | CRTSCTS);
+	tio.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER;
+
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+
+	tio.c_cc[VMIN]  = 1;
+	tio.c_cc[VTIME] = 0;
+
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+//Returns 0, or -1 and errno
+int tbms_serial_open(struct tbms_serial *self, const char *path)
+{
+	self->tx_pos   = 0;
+	self->readable = true; //Nothing is known yet, try to read
+	self->writable = true;
+
+	self->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if (self->fd < 0)
+		return -1;
+
+	if (tbms_serial_config(self->fd, TBMS_SERIAL_BAUD) < 0) {
+		int err = errno;
+
+		close(self->fd);
+		self->fd = -1;
+
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+void tbms_serial_close(struct tbms_serial *self)
+{
+	if (self->fd >= 0)
+		close(self->fd);
+
+	self->fd = -1;
+}
+
+/* Writes pending TX frame. Returns 1 once whole frame was sent, 0 if port
+ * is busy (try again later), -1 and errno on error. */
+int tbms_serial_tx(struct tbms_serial *self, struct tbms *tb)
+{
+	size_t len = tbms_get_tx_len(tb);
+	ssize_t n;
+
+	if (!tbms_tx_available(tb) || !self->writable)
+		return 0;
+
+	//Anything received so far is stale (like UART flush before TX)
+	if (!self->tx_pos && ioctl(self->fd, TCFLSH, TCIFLUSH) == 0)
+		self->readable = false;
+
+	n = write(self->fd, tbms_get_tx_buf(tb) + self->tx_pos,
+		  len - self->tx_pos);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			return -1;
+
+		self->writable = errno == EINTR;
+		return 0;
+	}
+
+	self->tx_pos += (size_t)n;
+
+	//Short write, tty is full until next EPOLLOUT
+	if (self->tx_pos < len) {
+		self->writable = false;
+		return 0;
+	}
+
+	self->tx_pos = 0;
+	tbms_tx_flush(tb);
+
+	return 1;
+}
+
+/* Reads no more than current reply still needs, the rest stays in tty for
+ * the next reply. Returns number of bytes passed to library, -1 and errno
+ * on error. */
+ssize_t tbms_serial_rx(struct tbms_serial *self, struct tbms *tb)
+{
+	size_t len;
+	uint8_t *buf = tbms_get_rx_buf(tb, &len);
+	ssize_t n;
+
+	if (!buf || !self->readable)
+		return 0;
+
+	n = read(self->fd, buf, len);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			return -1;
+
+		self->readable = false;
+		return 0;
+	}
+
+	//Short read, tty is drained until next EPOLLIN
+	if ((size_t)n < len)
+		self->readable = false;
+
+	tbms_rx_commit(tb, (size_t)n);
+
+	return n;
+}
+
+#endif //TBMS_SERIAL_H
@@ -0,0 +1,141 @@
+#define TBMS_SNAPSHOT
+#include <pthread.h>
+
+#include "tesla_bms.h"
+#include "tbms_emu.h"
+
+/* Library runs against emulated modules in main thread, readers copy
+ * snapshots in other threads. All cells of the chain are set to a new
+ * voltage after every sweep, so a snapshot mixing two sweeps (or a half
+ * written one) has cells that differ. */
+
+#define MODULES 8
+#define SWEEPS  300
+#define READERS 2
+
+static struct tbms              tb;
+static struct tbms_emu          emu;
+static struct tbms_snapshot_buf snapshot;
+
+static bool done;
+
+struct reader {
+	pthread_t thread;
+
+	unsigned reads;
+	unsigned torn;      //Cells of different sweeps
+	unsigned backwards; //Sweep number went down
+};
+
+//Same voltage for every cell of the chain, "step" selects which one
+void set_cells(unsigned step)
+{
+	for (int i = 0; i < MODULES; i++)
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			tbms_emu_set_cell(&emu, (uint8_t)i, (uint8_t)j,
+					  3.5f + (float)(step % 25) * 0.01f);
+}
+
+bool snapshot_consistent(const struct tbms_snapshot *s)
+{
+	for (int i = 0; i < MODULES; i++)
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			if (s->cell[i][j] != s->cell[0][0])
+				return false;
+
+	return s->pack.cell_min == s->cell[0][0] &&
+	       s->pack.cell_max == s->cell[0][0];
+}
+
+void *reader_run(void *arg)
+{
+	struct reader *r = arg;
+	struct tbms_snapshot s;
+	uint32_t last = 0;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		if (!tbms_snapshot_read(&snapshot, &s))
+			continue;
+
+		r->reads++;
+		r->backwards += s.sweep < last;
+		last = s.sweep;
+
+		//Values of all modules are known from the second sweep on
+		if (s.ready && s.sweep > 1 && !snapshot_consistent(&s))
+			r->torn++;
+	}
+
+	return NULL;
+}
+
+void update()
+{
+	if (tbms_tx_available(&tb)) {
+		tbms_emu_flush(&emu);
+		tbms_emu_write(&emu, tbms_get_tx_buf(&tb), tbms_get_tx_len(&tb));
+		tbms_tx_flush(&tb);
+	}
+
+	if (tbms_rx_available(&tb)) {
+		size_t len;
+		uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+		tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+	}
+
+	tbms_emu_update(&emu, 1);
+	tbms_update(&tb, 1);
+}
+
+int main()
+{
+	struct reader r[READERS] = { 0 };
+	struct tbms_snapshot s;
+	uint32_t sweeps = 0;
+	int failed = 0;
+
+	tbms_emu_init(&emu, MODULES);
+	set_cells(0);
+
+	tbms_init(&tb);
+	tbms_snapshot_init(&snapshot);
+	tbms_set_snapshot(&tb, &snapshot);
+
+	for (int i = 0; i < READERS; i++)
+		pthread_create(&r[i].thread, NULL, reader_run, &r[i]);
+
+	while (tb.sweeps < SWEEPS) {
+		update();
+
+		if (tb.sweeps != sweeps) {
+			sweeps = tb.sweeps;
+			set_cells(sweeps);
+		}
+	}
+
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < READERS; i++) {
+		pthread_join(r[i].thread, NULL);
+
+		bool ok = r[i].reads && !r[i].torn && !r[i].backwards;
+
+		printf("reader %i: %u reads, %u torn, %u backwards, %s\n", i,
+		       r[i].reads, r[i].torn, r[i].backwards,
+		       ok ? "OK" : "FAIL");
+		failed += !ok;
+	}
+
+	//Last publication is the last sweep
+	bool ok = tbms_snapshot_read(&snapshot, &s) && s.sweep == SWEEPS &&
+		  s.ready && s.modules_count == MODULES &&
+		  tbms_snapshot_get_pack_voltage(&s) ==
+		  tbms_get_pack_voltage(&tb);
+
+	printf("last snapshot: sweep %u, %s\n", (unsigned)s.sweep,
+	       ok ? "OK" : "FAIL");
+	failed += !ok;
+
+	return failed ? 1 : 0;
+}
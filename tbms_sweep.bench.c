@@ -0,0 +1,254 @@
+#define _GNU_SOURCE //clock_gettime
+
+#include <stdlib.h>
+
+#include "tesla_bms.h"
+#include "tbms_emu.h"
+
+/* Steady state polling cost against emulated chains of 1..62 modules.
+ * Prints one tab separated row per module count. With a baseline file
+ * (previous output) as argument, exits with 1 if any row regressed.
+ *
+ * Sweeps run from one conversion to the next, whole polling cycles (see
+ * TBMS_POLL_SLOW) are measured. A round is the bus traffic between two
+ * sleeps of the library (see tbms.sleep), round figures are of the longest
+ * one (conversion and value reads of every module, latency of a sweep).
+ * Other bus figures are per second of simulated time. Chain answers instantly and
+ * time only advances when library is idle, so everything except CPU time is
+ * deterministic. Bus time is wire time of all bytes at 615384 baud (10 bits
+ * per byte), without module latency. CPU time is of the fastest sweep, timer
+ * overhead included. With TBMS_DEBUG a log ring is attached, records are
+ * popped outside of measured time (as by a drain task). */
+
+#define BENCH_SWEEPS         10
+#define BENCH_BAUD           615384
+#define BENCH_CPU_TOLERANCE  3.0 //CPU time is noisy and machine dependent
+
+struct bench_result {
+	unsigned modules;
+	unsigned round_tx;     //Transactions of longest round
+	unsigned round_us;     //Bus time of longest round
+	unsigned transactions; //Per second
+	unsigned tx_bytes;
+	unsigned rx_bytes;
+	unsigned bus_us;       //Per second
+	unsigned updates;      //tbms_update calls (with bus activity) per second
+	double   ns_per_update;
+};
+
+static struct tbms     tb;
+static struct tbms_emu emu;
+
+#ifdef TBMS_DEBUG
+static struct tbms_log tb_log;
+
+//Consumer side, formatting is not what is measured
+static void bench_log_drain(void)
+{
+	struct tbms_log_rec rec;
+
+	while (tbms_log_pop(&tb_log, &rec))
+		;
+}
+#endif
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned bench_bus_us(uint32_t bytes)
+{
+	return (unsigned)(bytes * 10 * 1000000ULL / BENCH_BAUD);
+}
+
+//Sweep starts with conversion of whole chain (or of first module)
+static bool sweep_start(const uint8_t *frame)
+{
+	return frame[1] == TBMS_REG_ADC_CONV &&
+	       (frame[0] == TBMS_BROADCAST ||
+		frame[0] == (TBMS_WRITE | TBMS_MODULE(1)));
+}
+
+void bench_sweep(unsigned modules, struct bench_result *res)
+{
+	unsigned sweeps = 0, updates = 0, sweep_updates = 0;
+	uint32_t frames = 0, tx_bytes = 0, rx_bytes = 0;
+	uint32_t round_frames = 0, round_bytes = 0;
+	clock_t start_time = 0, ms;
+	long long cpu_ns = 0;
+	double best_ns = 0;
+	bool progress = false, asleep = false;
+
+	tbms_emu_init(&emu, (uint8_t)modules);
+	tbms_init(&tb);
+
+	TBMS_DEBUG_DO(tbms_log_init(&tb_log);
+		      tbms_set_log(&tb, &tb_log));
+
+	res->round_tx = 0;
+	res->round_us = 0;
+
+	for (;;) {
+		enum tbms_io_state io_state = tb.io.state;
+
+		if (tbms_tx_available(&tb)) {
+			uint8_t *buf = tbms_get_tx_buf(&tb);
+
+			//First sweep differs (register shadow is cold)
+			if (sweep_start(buf) && tbms_is_ready(&tb)) {
+				if (++sweeps == 2) {
+					frames   = emu.frames;
+					tx_bytes = emu.tx_bytes;
+					rx_bytes = emu.rx_bytes;
+					updates  = 0;
+
+					start_time = tb.time;
+				}
+
+				//Least disturbed sweep (preemption, cache misses)
+				if (sweeps > 2 && (!best_ns || (double)cpu_ns /
+						   sweep_updates < best_ns))
+					best_ns = (double)cpu_ns / sweep_updates;
+
+				cpu_ns = 0;
+				sweep_updates = 0;
+
+				if (sweeps == BENCH_SWEEPS + 2)
+					break;
+			}
+
+			tbms_emu_flush(&emu);
+			tbms_emu_write(&emu, buf, tbms_get_tx_len(&tb));
+			tbms_tx_flush(&tb);
+		}
+
+		if (tbms_rx_available(&tb)) {
+			size_t len;
+			uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+			tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+		}
+
+		//Time stands still while there is bus traffic
+		progress = progress || tb.io.state != io_state;
+
+		tbms_emu_update(&emu, progress ? 0 : 1);
+
+		if (progress) {
+			long long start = now_ns();
+
+			tbms_update(&tb, 0);
+
+			cpu_ns += now_ns() - start;
+			sweep_updates++;
+			updates++;
+		} else {
+			tbms_update(&tb, 1);
+		}
+
+		progress = tb.io.state != io_state;
+
+		TBMS_DEBUG_DO(bench_log_drain());
+
+		//Round ends when library goes to sleep
+		if (!tb.sleep != !asleep) {
+			uint32_t bytes = emu.tx_bytes + emu.rx_bytes;
+
+			asleep = tb.sleep != 0;
+
+			if (asleep && sweeps >= 2) {
+				unsigned tx = emu.frames - round_frames;
+				unsigned us = bench_bus_us(bytes - round_bytes);
+
+				if (tx > res->round_tx)
+					res->round_tx = tx;
+				if (us > res->round_us)
+					res->round_us = us;
+			}
+
+			round_frames = emu.frames;
+			round_bytes  = bytes;
+		}
+	}
+
+	ms = tb.time - start_time;
+
+	res->modules       = modules;
+	res->transactions  = (unsigned)((emu.frames - frames) * 1000ULL / ms);
+	res->tx_bytes      = (unsigned)((emu.tx_bytes - tx_bytes) * 1000ULL / ms);
+	res->rx_bytes      = (unsigned)((emu.rx_bytes - rx_bytes) * 1000ULL / ms);
+	res->bus_us        = bench_bus_us(res->tx_bytes + res->rx_bytes);
+	res->updates       = (unsigned)(updates * 1000ULL / ms);
+	res->ns_per_update = best_ns;
+}
+
+//Returns number of regressions against "path"
+int bench_compare(const char *path, const struct bench_result *res,
+		  unsigned count)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int failed = 0;
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct bench_result b;
+
+		if (line[0] == '#' ||
+		    sscanf(line, "%u %u %u %u %u %u %u %u %lf", &b.modules,
+			   &b.round_tx, &b.round_us, &b.transactions,
+			   &b.tx_bytes, &b.rx_bytes, &b.bus_us, &b.updates,
+			   &b.ns_per_update) != 9 ||
+		    !b.modules || b.modules > count)
+			continue;
+
+		const struct bench_result *r = &res[b.modules - 1];
+
+		if (r->round_tx > b.round_tx || r->round_us > b.round_us ||
+		    r->transactions > b.transactions ||
+		    r->tx_bytes > b.tx_bytes || r->rx_bytes > b.rx_bytes ||
+		    r->updates > b.updates ||
+		    r->ns_per_update > b.ns_per_update * BENCH_CPU_TOLERANCE) {
+			fprintf(stderr, "regression at %u modules\n",
+				b.modules);
+			failed++;
+		}
+	}
+
+	fclose(f);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	static struct bench_result res[TBMS_MAX_MODULES];
+
+	printf("#modules\tround_tx\tround_us\ttransactions\ttx_bytes\t"
+	       "rx_bytes\tbus_us\tupdates\tns_per_update\n");
+
+	for (unsigned n = 1; n <= TBMS_MAX_MODULES; n++) {
+		bench_sweep(n, &res[n - 1]);
+
+		printf("%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%.1f\n",
+		       res[n - 1].modules, res[n - 1].round_tx,
+		       res[n - 1].round_us, res[n - 1].transactions,
+		       res[n - 1].tx_bytes,
+		       res[n - 1].rx_bytes, res[n - 1].bus_us,
+		       res[n - 1].updates, res[n - 1].ns_per_update);
+	}
+
+	if (argc > 1 && bench_compare(argv[1], res, TBMS_MAX_MODULES))
+		return 1;
+
+	return 0;
+}
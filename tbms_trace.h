@@ -0,0 +1,184 @@
+#ifndef TBMS_TRACE_H
+#define TBMS_TRACE_H
+
+/* Replay and dump of traces recorded with TBMS_TRACE (see tbms_set_trace).
+ * Replay feeds recorded RX bytes and update deltas back into a freshly
+ * initialized library and checks that it sends the same frames and goes
+ * through the same states, so a field capture becomes a deterministic
+ * regression test. Does not need TBMS_TRACE itself.
+ *
+ * Trace must start right after tbms_init and be complete (no lost
+ * records). */
+
+#include <stdio.h>
+
+#include "tesla_bms.h"
+
+enum tbms_replay_event {
+	TBMS_REPLAY_EVENT_OK,
+	TBMS_REPLAY_EVENT_MISMATCH, //Library differs from the recording
+	TBMS_REPLAY_EVENT_END,
+	TBMS_REPLAY_EVENT_CORRUPT   //Truncated record
+};
+
+struct tbms_replay {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;   //Of next record
+
+	clock_t time; //Sum of replayed deltas
+
+	uint32_t mismatches;
+	size_t   first_mismatch; //Record offset, valid if mismatches
+};
+
+void tbms_replay_init(struct tbms_replay *self, const uint8_t *data,
+		      size_t len)
+{
+	self->data = data;
+	self->len  = len;
+	self->pos  = 0;
+	self->time = 0;
+
+	self->mismatches     = 0;
+	self->first_mismatch = 0;
+}
+
+/* Parses record at "pos", returns its data length (or -1 if truncated)
+ * and header, decoded delta for UPDATE records. */
+int tbms_replay_record(const uint8_t *data, size_t len, size_t pos,
+		       uint8_t *header, clock_t *delta)
+{
+	uint8_t h = data[pos];
+	size_t  n = 0;
+
+	*header = h;
+	*delta  = 0;
+
+	if (TBMS_TRACE_TYPE(h) != TBMS_TRACE_UPDATE)
+		n = TBMS_TRACE_TYPE(h) == TBMS_TRACE_STATE ? 1 :
+		    TBMS_TRACE_ARG(h);
+	else if (TBMS_TRACE_ARG(h) == TBMS_TRACE_LONG)
+		n = 4;
+
+	if (pos + 1 + n > len)
+		return -1;
+
+	if (TBMS_TRACE_TYPE(h) == TBMS_TRACE_UPDATE)
+		*delta = n ? (clock_t)((uint32_t)data[pos + 1] |
+				       (uint32_t)data[pos + 2] << 8 |
+				       (uint32_t)data[pos + 3] << 16 |
+				       (uint32_t)data[pos + 4] << 24) :
+			     (clock_t)TBMS_TRACE_ARG(h);
+
+	return (int)n;
+}
+
+//Replays one record into "tb"
+enum tbms_replay_event tbms_replay_step(struct tbms_replay *self,
+					struct tbms *tb)
+{
+	const uint8_t *d;
+	uint8_t header;
+	clock_t delta;
+	bool ok = true;
+	int n;
+
+	if (self->pos >= self->len)
+		return TBMS_REPLAY_EVENT_END;
+
+	n = tbms_replay_record(self->data, self->len, self->pos, &header,
+			       &delta);
+	if (n < 0)
+		return TBMS_REPLAY_EVENT_CORRUPT;
+
+	d = &self->data[self->pos + 1];
+
+	switch (TBMS_TRACE_TYPE(header)) {
+	case TBMS_TRACE_UPDATE:
+		tbms_update(tb, delta);
+		self->time += delta;
+		break;
+
+	case TBMS_TRACE_TX:
+		ok = tbms_tx_available(tb) &&
+		     tbms_get_tx_len(tb) == (size_t)n &&
+		     !memcmp(tbms_get_tx_buf(tb), d, (size_t)n);
+
+		tbms_tx_flush(tb);
+		break;
+
+	case TBMS_TRACE_RX:
+		ok = tbms_set_rx_buf(tb, d, (size_t)n) == (size_t)n;
+		break;
+
+	case TBMS_TRACE_STATE:
+		ok = (uint8_t)tb->state == d[0] &&
+		     (uint8_t)tb->io.state == TBMS_TRACE_ARG(header);
+		break;
+	}
+
+	if (!ok && !self->mismatches++)
+		self->first_mismatch = self->pos;
+
+	self->pos += 1 + (size_t)n;
+
+	return ok ? TBMS_REPLAY_EVENT_OK : TBMS_REPLAY_EVENT_MISMATCH;
+}
+
+/* Replays whole trace into "tb" (initialized with tbms_init). Returns
+ * number of mismatching records, or -1 if trace is truncated. */
+long tbms_replay_run(struct tbms_replay *self, struct tbms *tb)
+{
+	enum tbms_replay_event event;
+
+	while ((event = tbms_replay_step(self, tb)) != TBMS_REPLAY_EVENT_END)
+		if (event == TBMS_REPLAY_EVENT_CORRUPT)
+			return -1;
+
+	return (long)self->mismatches;
+}
+
+//Prints trace as text, one timestamped line per frame or transition
+void tbms_trace_dump(FILE *f, const uint8_t *data, size_t len)
+{
+	clock_t time = 0;
+	size_t pos = 0;
+
+	while (pos < len) {
+		uint8_t header;
+		clock_t delta;
+		int n = tbms_replay_record(data, len, pos, &header, &delta);
+
+		if (n < 0) {
+			fprintf(f, "[%6li] truncated record\n", (long)time);
+			return;
+		}
+
+		switch (TBMS_TRACE_TYPE(header)) {
+		case TBMS_TRACE_UPDATE:
+			time += delta;
+			break;
+
+		case TBMS_TRACE_STATE:
+			fprintf(f, "[%6li] state %u io %u\n", (long)time,
+				data[pos + 1], TBMS_TRACE_ARG(header));
+			break;
+
+		default:
+			fprintf(f, "[%6li] %s", (long)time,
+				TBMS_TRACE_TYPE(header) == TBMS_TRACE_TX ?
+				"tx" : "rx");
+
+			for (int i = 0; i < n; i++)
+				fprintf(f, " 0x%02X", data[pos + 1 + i]);
+
+			fprintf(f, "\n");
+			break;
+		}
+
+		pos += 1 + (size_t)n;
+	}
+}
+
+#endif //TBMS_TRACE_H
@@ -0,0 +1,112 @@
+#define TBMS_TRACE
+#include "tesla_bms.h"
+#include "tbms_emu.h"
+#include "tbms_trace.h"
+
+/* Records a session against emulated modules (with injected errors), then
+ * replays the capture into a fresh instance. Replay must match record by
+ * record and end in the same state, a corrupted capture must not. */
+
+#define TICKS 8000
+
+static struct tbms       tb;
+static struct tbms_emu   emu;
+static struct tbms_trace trace;
+
+//Drained trace, as it would be written to a file
+static uint8_t capture[1 << 16];
+static size_t  capture_len;
+
+void update()
+{
+	if (tbms_tx_available(&tb)) {
+		tbms_emu_flush(&emu);
+		tbms_emu_write(&emu, tbms_get_tx_buf(&tb), tbms_get_tx_len(&tb));
+		tbms_tx_flush(&tb);
+	}
+
+	if (tbms_rx_available(&tb)) {
+		size_t len;
+		uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+		tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+	}
+
+	tbms_emu_update(&emu, 1);
+	tbms_update(&tb, 1);
+
+	capture_len += tbms_trace_read(&trace, &capture[capture_len],
+				       sizeof(capture) - capture_len);
+}
+
+//Returns number of mismatches
+long replay(const uint8_t *data, size_t len, struct tbms *out)
+{
+	struct tbms_replay r;
+
+	tbms_init(out);
+	tbms_replay_init(&r, data, len);
+
+	return tbms_replay_run(&r, out);
+}
+
+int main()
+{
+	static struct tbms replayed;
+	int failed = 0;
+	long n;
+
+	tbms_emu_init(&emu, 3);
+	tbms_emu_set_cell(&emu, 1, 0, 3.9f);
+
+	tbms_init(&tb);
+	tbms_trace_init(&trace);
+	tbms_set_trace(&tb, &trace);
+
+	for (int i = 0; i < TICKS; i++) {
+		if (i == 2500)
+			tbms_emu_inject(&emu, TBMS_EMU_ERROR_BAD_CRC, 1);
+		if (i == 4000)
+			tbms_emu_inject(&emu, TBMS_EMU_ERROR_DROP_BYTE, 1);
+
+		update();
+	}
+
+	printf("recorded %zu bytes, %u records lost, %s\n", capture_len,
+	       (unsigned)trace.lost, trace.lost ? "FAIL" : "OK");
+	failed += trace.lost != 0;
+
+	n = replay(capture, capture_len, &replayed);
+
+	bool same = tbms_is_ready(&replayed) == tbms_is_ready(&tb) &&
+		    replayed.modules_count == tb.modules_count &&
+		    replayed.time == tb.time &&
+		    tbms_get_pack_voltage(&replayed) ==
+		    tbms_get_pack_voltage(&tb);
+
+	printf("replay: %li mismatches, same end state %s, %s\n", n,
+	       same ? "yes" : "no", !n && same ? "OK" : "FAIL");
+	failed += n || !same;
+
+	//Flip a bit in the first received byte
+	for (size_t pos = 0; pos < capture_len; ) {
+		uint8_t header;
+		clock_t delta;
+		int len = tbms_replay_record(capture, capture_len, pos,
+					     &header, &delta);
+
+		if (TBMS_TRACE_TYPE(header) == TBMS_TRACE_RX) {
+			capture[pos + 1] ^= 0x01;
+			break;
+		}
+
+		pos += 1 + (size_t)len;
+	}
+
+	n = replay(capture, capture_len, &replayed);
+
+	printf("corrupted replay: %li mismatches, %s\n", n, n ? "OK" : "FAIL");
+	failed += !n;
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+#ifndef ARDUINO
+#include "tesla_bms.h"
+
+#define BENCH_BUF_LEN   4096
+#define BENCH_MIN_TIME  (CLOCKS_PER_SEC / 4)
+
+static uint8_t data[BENCH_BUF_LEN];
+
+/* Runs crc function until at least BENCH_MIN_TIME passed, returns bytes/s.
+ * CRC of the whole buffer goes to "result". */
+double bench_crc(uint8_t (*crc)(uint8_t *data, int len), uint8_t *result)
+{
+	clock_t start = clock();
+	clock_t elapsed;
+	size_t  bytes = 0;
+	volatile uint8_t last = 0; //Calls can not be optimized away
+
+	do {
+		for (int i = 0; i < 64; i++) {
+			last = crc(data, BENCH_BUF_LEN);
+			bytes += BENCH_BUF_LEN;
+		}
+
+		elapsed = clock() - start;
+	} while (elapsed < BENCH_MIN_TIME);
+
+	*result = last;
+
+	return bytes / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+int main()
+{
+	static const struct {
+		const char *name;
+		uint8_t (*crc)(uint8_t *data, int len);
+	} variants[] = {
+		{ "bitwise", tbms_gen_crc_bitwise },
+#ifndef TBMS_CRC_NIBBLE
+		{ "table",   tbms_gen_crc_table   },
+#endif
+		{ "nibble",  tbms_gen_crc_nibble  }
+	};
+
+	printf("sizeof(struct tbms) %zu bytes (TBMS_MAX_MODULES %i)\n",
+	       sizeof(struct tbms), TBMS_MAX_MODULES);
+
+	for (int i = 0; i < BENCH_BUF_LEN; i++)
+		data[i] = (uint8_t)(i * 131 + 7);
+
+	//All variants must agree with reference, otherwise numbers are useless
+	for (int len = 0; len < 64; len++) {
+		uint8_t ref = tbms_gen_crc_bitwise(data, len);
+
+		for (size_t v = 1; v < sizeof(variants) / sizeof(*variants); v++) {
+			if (variants[v].crc(data, len) != ref) {
+				printf("crc %s mismatch (len %i)\n",
+				       variants[v].name, len);
+				return 1;
+			}
+		}
+	}
+
+	uint8_t ref = tbms_gen_crc_bitwise(data, BENCH_BUF_LEN);
+	int failed = 0;
+
+	for (size_t v = 0; v < sizeof(variants) / sizeof(*variants); v++) {
+		uint8_t res;
+		double  rate = bench_crc(variants[v].crc, &res);
+
+		printf("crc %-8s %12.0f bytes/s (0x%02X), %s\n",
+		       variants[v].name, rate, res, res == ref ? "OK" : "FAIL");
+		failed += res != ref;
+	}
+
+	return failed ? 1 : 0;
+}
+#endif
@@ -1,3 +1,6 @@
+#ifndef TESLA_BMS_H
+#define TESLA_BMS_H
+
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
@@ -28,9 +31,115 @@ typedef void * async;
 #define TBMS_MAX_COMMANDS    20
 #define TBMS_MAX_IO_BUF      40
 
-//TODO make these configurable
+//Number of modules memory is reserved for (up to TBMS_MAX_MODULE_ADDR)
+#ifndef TBMS_MAX_MODULES
+#define TBMS_MAX_MODULES     TBMS_MAX_MODULE_ADDR
+#endif
+
+#if TBMS_MAX_MODULES > TBMS_MAX_MODULE_ADDR || TBMS_MAX_MODULES < 1
+#error "TBMS_MAX_MODULES must be within 1..TBMS_MAX_MODULE_ADDR"
+#endif
+
+/* By default ADC is configured and conversion is started once per sweep for
+ * the whole chain (broadcast), so all cells are sampled at the same time.
+ * Define this to configure and start conversion separately for each module
+ * right before it is read (4 transactions per module instead of 1). */
+//#define TBMS_PER_MODULE_CONVERSION
+
+/* Define this to read values and status of a module in one burst (GPAI up
+ * to CUV_FAULT, see tbms_task_read_module_burst) instead of two reads, both
+ * whenever either is due. One transaction and coherent data per module, at
+ * the cost of 13 reserved bytes (0x13..0x1F) on the wire. */
+//#define TBMS_BURST_READ
+
+//Defaults, see tbms_set_balance_config()
 #define TBMS_BALANCE_VOLTAGE 3.8
 #define TBMS_BALANCE_HYST    0.04
+/* Hardware balance timer, TBMS_REG_BAL_TIME value: bits 0-6 are the count,
+ * bit 7 set counts minutes instead of seconds (0x82 is 2 minutes). */
+#define TBMS_BALANCE_TIME    0x82
+
+//Duration (ms) of BAL_TIME register value "t"
+#define TBMS_BAL_TIME_MS(t)  (((t) & 0x7F) * ((t) & 0x80 ? 60000L : 1000L))
+
+/* Balancing is re-armed when it runs this long (ms), TBMS_BALANCE_MARGIN
+ * before hardware timer expires. Balance is evaluated once per polling
+ * round, so the margin must be longer than rounds are apart. */
+#define TBMS_BALANCE_MARGIN  10000L
+#define TBMS_BALANCE_REARM   (TBMS_BAL_TIME_MS(TBMS_BALANCE_TIME) - \
+			      TBMS_BALANCE_MARGIN)
+
+/* Balancing duty is averaged over roughly this many ms (older history is
+ * halved each time the window fills up). Must be below 32768. */
+#define TBMS_BALANCE_DUTY_WINDOW 30000
+
+/* Adaptive polling, ms between value reads of a module:
+ * - TBMS_POLL_FAST if a cell is outside TBMS_POLL_CELL_LOW..HIGH volts, a
+ *   temperature moved by TBMS_POLL_TEMP_STEP C since last read or module is
+ *   faulted,
+ * - TBMS_POLL_SLOW if no cell moved by TBMS_POLL_STABLE_MV,
+ * - TBMS_POLL_NORMAL otherwise.
+ * Status is read every TBMS_POLL_STATUS ms (faulted modules TBMS_POLL_FAST).
+ * No value is older than TBMS_POLL_SLOW plus one round of reads, see
+ * tbms_get_pack_age. */
+#define TBMS_POLL_FAST      250
+#define TBMS_POLL_NORMAL    1000
+#define TBMS_POLL_SLOW      3000
+#define TBMS_POLL_STATUS    1000
+#define TBMS_POLL_CELL_LOW  3.0
+#define TBMS_POLL_CELL_HIGH 4.1
+#define TBMS_POLL_STABLE_MV 5
+#define TBMS_POLL_TEMP_STEP 1.0
+
+#if TBMS_BALANCE_MARGIN <= TBMS_POLL_SLOW
+#error "TBMS_BALANCE_MARGIN must be longer than TBMS_POLL_SLOW"
+#endif
+
+//Volts per ADC count
+#define TBMS_CELL_LSB        0.000381493f
+#define TBMS_MODULE_LSB      0.002034609f
+
+/* For targets without FPU. Voltages are stored as raw ADC counts and
+ * temperatures in 0.01C, so decoding and balancing use integer math only.
+ * Float getters convert on demand. Cell voltages are 0 (not NAN) until
+ * first read. */
+//#define TBMS_FIXED_POINT
+
+#ifdef TBMS_FIXED_POINT
+typedef uint16_t tbms_volt_t;
+typedef int16_t  tbms_temp_t;
+
+#define TBMS_VOLT_MAX         UINT16_MAX
+#define TBMS_CELL_UNKNOWN     0
+#define TBMS_CELL_VOLT(raw)   ((tbms_volt_t)(raw))
+#define TBMS_MODULE_VOLT(raw) ((tbms_volt_t)(raw))
+#define TBMS_TEMP(raw)        tbms_temp_centi(raw)
+#define TBMS_VOLTS(v)         ((tbms_volt_t)((v) / TBMS_CELL_LSB + 0.5f))
+//Millivolts to ADC counts, 171788 = 65536 / 1000 / TBMS_CELL_LSB
+#define TBMS_MILLIVOLTS(mv)   ((tbms_volt_t) \
+			       (((uint32_t)(mv) * 171788UL + 32768) >> 16))
+#define TBMS_CELL_TO_F(v)     ((v) * TBMS_CELL_LSB)
+#define TBMS_MODULE_TO_F(v)   ((v) * TBMS_MODULE_LSB)
+#define TBMS_TEMP_TO_F(t)     ((t) == TBMS_TEMP_INVALID ? NAN : (t) * 0.01f)
+#define TBMS_TEMP_VALID(t)    ((t) != TBMS_TEMP_INVALID)
+#define TBMS_DEGREES(c)       ((tbms_temp_t)((c) * 100))
+#else
+typedef float tbms_volt_t;
+typedef float tbms_temp_t;
+
+#define TBMS_VOLT_MAX         FLT_MAX
+#define TBMS_CELL_UNKNOWN     NAN
+#define TBMS_CELL_VOLT(raw)   ((raw) * TBMS_CELL_LSB)
+#define TBMS_MODULE_VOLT(raw) ((raw) * TBMS_MODULE_LSB)
+#define TBMS_TEMP(raw)        tbms_temp_from_raw(raw)
+#define TBMS_VOLTS(v)         (v)
+#define TBMS_MILLIVOLTS(mv)   ((mv) * 0.001f)
+#define TBMS_CELL_TO_F(v)     (v)
+#define TBMS_MODULE_TO_F(v)   (v)
+#define TBMS_TEMP_TO_F(t)     (t)
+#define TBMS_TEMP_VALID(t)    (!isnan(t))
+#define TBMS_DEGREES(c)       ((tbms_temp_t)(c))
+#endif
 
 //////////////////////////// REGISTER RELATED STUFF ///////////////////////////
 #define TBMS_READ       0x00
@@ -60,11 +169,46 @@ typedef void * async;
 #define TBMS_REG_ADDR_CTRL       0x3B
 #define TBMS_REG_RESET           0x3C
 
+//Writable registers which values are cached (TBMS_REG_ADC_CTRL..BAL_TIME)
+#define TBMS_SHADOW_FIRST        TBMS_REG_ADC_CTRL
+#define TBMS_SHADOW_REGS         4
+
 #define TBMS_DATA_SEL_ALL  0xFF
 #define TBMS_DATA_CLR_ZRO  0x00
 
+//Data bytes of burst read, from TBMS_REG_GPAI up to TBMS_REG_CUV_FAULT
+#define TBMS_BURST_LEN     (TBMS_REG_CUV_FAULT + 1 - TBMS_REG_GPAI)
+
+//Header, data and CRC of the longest reply
+#if TBMS_MAX_IO_BUF < 3 + TBMS_BURST_LEN + 1
+#error "TBMS_MAX_IO_BUF is too small for burst read"
+#endif
+
 /////////////////////////// GLOBAL & GENERIC FUNCTIONS ////////////////////////
-uint8_t tbms_gen_crc(uint8_t *data, int len)
+/* CRC-8, polynomial 0x07 (x^8 + x^2 + x + 1), initial value 0.
+ * The CRC is linear, so the CRC of any byte is the XOR of the CRCs of its set
+ * bits. This lets the preprocessor generate the lookup tables at compile time.
+ * Define TBMS_CRC_NIBBLE to use a 16 byte table instead of 256 byte one
+ * (for flash constrained targets, roughly half the speed). */
+#define TBMS_CRC_T(b) ((uint8_t)(((b) & 0x01 ? 0x07 : 0) ^ \
+				 ((b) & 0x02 ? 0x0E : 0) ^ \
+				 ((b) & 0x04 ? 0x1C : 0) ^ \
+				 ((b) & 0x08 ? 0x38 : 0) ^ \
+				 ((b) & 0x10 ? 0x70 : 0) ^ \
+				 ((b) & 0x20 ? 0xE0 : 0) ^ \
+				 ((b) & 0x40 ? 0xC7 : 0) ^ \
+				 ((b) & 0x80 ? 0x89 : 0)))
+#define TBMS_CRC_T4(b)   TBMS_CRC_T(b),        TBMS_CRC_T((b) + 1), \
+			 TBMS_CRC_T((b) + 2),  TBMS_CRC_T((b) + 3)
+#define TBMS_CRC_T16(b)  TBMS_CRC_T4(b),       TBMS_CRC_T4((b) + 4), \
+			 TBMS_CRC_T4((b) + 8), TBMS_CRC_T4((b) + 12)
+#define TBMS_CRC_T64(b)  TBMS_CRC_T16(b),        TBMS_CRC_T16((b) + 16), \
+			 TBMS_CRC_T16((b) + 32), TBMS_CRC_T16((b) + 48)
+#define TBMS_CRC_T256(b) TBMS_CRC_T64(b),         TBMS_CRC_T64((b) + 64), \
+			 TBMS_CRC_T64((b) + 128), TBMS_CRC_T64((b) + 192)
+
+//Reference implementation, 8 shifts per byte
+uint8_t tbms_gen_crc_bitwise(uint8_t *data, int len)
 {
 	uint8_t generator = 0x07;
 	uint8_t crc = 0;
@@ -83,262 +227,1626 @@ uint8_t tbms_gen_crc(uint8_t *data, int len)
 	return crc;
 }
 
+static const uint8_t tbms_crc_nibble_table[16] = { TBMS_CRC_T16(0) };
+
+uint8_t tbms_crc_byte_nibble(uint8_t crc, uint8_t byte)
+{
+	crc ^= byte;
+	crc = (uint8_t)(crc << 4) ^ tbms_crc_nibble_table[crc >> 4];
+	crc = (uint8_t)(crc << 4) ^ tbms_crc_nibble_table[crc >> 4];
+
+	return crc;
+}
+
+uint8_t tbms_gen_crc_nibble(uint8_t *data, int len)
+{
+	uint8_t crc = 0;
+
+	for (int i = 0; i < len; i++)
+		crc = tbms_crc_byte_nibble(crc, data[i]);
+
+	return crc;
+}
+
+#ifndef TBMS_CRC_NIBBLE
+static const uint8_t tbms_crc_table[256] = { TBMS_CRC_T256(0) };
+
+uint8_t tbms_crc_byte_table(uint8_t crc, uint8_t byte)
+{
+	return tbms_crc_table[crc ^ byte];
+}
+
+uint8_t tbms_gen_crc_table(uint8_t *data, int len)
+{
+	uint8_t crc = 0;
+
+	for (int i = 0; i < len; i++)
+		crc = tbms_crc_table[crc ^ data[i]];
+
+	return crc;
+}
+
+#define tbms_crc_byte tbms_crc_byte_table
+#else
+#define tbms_crc_byte tbms_crc_byte_nibble
+#endif
+
+uint8_t tbms_gen_crc(uint8_t *data, int len)
+{
+	uint8_t crc = 0;
+
+	for (int i = 0; i < len; i++)
+		crc = tbms_crc_byte(crc, data[i]);
+
+	return crc;
+}
+
+/* Thermistor temperature in 0.01 degrees C, indexed by raw ADC count / 64.
+ * Entries are the Steinhart-Hart equation that was used before:
+ *   R = (1.78 / ((raw + 2) / 33046) - 3.57) * 1000
+ *   T = 1 / (7.610373573e-4 + 2.728524832e-4 * ln(R) +
+ *            1.022822735e-7 * ln(R)^3) - 273.15
+ * clamped to 327.67. Linear interpolation between entries stays within
+ * 0.1C from the equation in -40..125C range (see tesla_bms.test.c). */
+#define TBMS_TEMP_LUT_SHIFT 6
+#define TBMS_TEMP_RAW_MAX   16474 //R <= 0 above this (shorted thermistor)
+#define TBMS_TEMP_INVALID   INT16_MIN
+
+static const int16_t tbms_temp_lut[] = {
+	-10574,  -6311,  -5277,  -4623,  -4136,  -3743,  -3412,  -3125,
+	 -2870,  -2640,  -2431,  -2238,  -2058,  -1891,  -1733,  -1584,
+	 -1443,  -1309,  -1180,  -1057,   -939,   -825,   -716,   -610,
+	  -507,   -407,   -311,   -217,   -125,    -36,     51,    136,
+	   219,    301,    380,    459,    535,    611,    685,    757,
+	   829,    899,    968,   1037,   1104,   1170,   1236,   1301,
+	  1364,   1427,   1490,   1551,   1612,   1673,   1732,   1792,
+	  1850,   1908,   1966,   2023,   2079,   2135,   2191,   2246,
+	  2301,   2355,   2409,   2463,   2516,   2569,   2622,   2674,
+	  2726,   2778,   2829,   2881,   2932,   2982,   3033,   3083,
+	  3133,   3183,   3233,   3283,   3332,   3381,   3430,   3479,
+	  3528,   3577,   3625,   3674,   3722,   3770,   3818,   3867,
+	  3914,   3962,   4010,   4058,   4106,   4154,   4201,   4249,
+	  4297,   4344,   4392,   4439,   4487,   4534,   4582,   4630,
+	  4677,   4725,   4773,   4821,   4868,   4916,   4964,   5012,
+	  5060,   5108,   5157,   5205,   5253,   5302,   5351,   5399,
+	  5448,   5497,   5546,   5596,   5645,   5695,   5744,   5794,
+	  5844,   5895,   5945,   5996,   6047,   6098,   6149,   6201,
+	  6252,   6304,   6357,   6409,   6462,   6515,   6568,   6622,
+	  6676,   6730,   6785,   6840,   6895,   6951,   7007,   7063,
+	  7120,   7177,   7235,   7293,   7351,   7410,   7469,   7529,
+	  7590,   7651,   7712,   7774,   7836,   7899,   7963,   8027,
+	  8092,   8158,   8224,   8291,   8359,   8427,   8496,   8566,
+	  8637,   8709,   8781,   8855,   8929,   9004,   9080,   9158,
+	  9236,   9316,   9396,   9478,   9561,   9646,   9731,   9819,
+	  9907,   9997,  10089,  10182,  10277,  10374,  10473,  10573,
+	 10676,  10780,  10887,  10997,  11109,  11223,  11340,  11460,
+	 11583,  11709,  11838,  11971,  12108,  12249,  12394,  12543,
+	 12698,  12857,  13022,  13193,  13371,  13555,  13746,  13946,
+	 14154,  14372,  14601,  14841,  15093,  15360,  15642,  15942,
+	 16261,  16603,  16970,  17367,  17798,  18270,  18790,  19368,
+	 20019,  20760,  21618,  22634,  23870,  25434,  27528,  30609,
+	 32767,  32767,  32767
+};
+
+int16_t tbms_temp_centi(uint16_t raw)
+{
+	uint16_t i = raw >> TBMS_TEMP_LUT_SHIFT;
+	int32_t  f = raw & ((1 << TBMS_TEMP_LUT_SHIFT) - 1);
+	int32_t  t0, t1;
+
+	if (raw > TBMS_TEMP_RAW_MAX)
+		return TBMS_TEMP_INVALID;
+
+	t0 = tbms_temp_lut[i];
+	t1 = tbms_temp_lut[i + 1];
+
+	return (int16_t)(t0 + ((t1 - t0) * f) / (1 << TBMS_TEMP_LUT_SHIFT));
+}
+
+float tbms_temp_from_raw(uint16_t raw)
+{
+	int16_t t = tbms_temp_centi(raw);
+
+	if (t == TBMS_TEMP_INVALID)
+		return NAN;
+
+	return t * 0.01f;
+}
+
+/////////////////////////////////// STATISTICS ////////////////////////////////
+/* Counters and round trip histograms, read through tbms_get_stats.
+ * Compiled out unless defined, when enabled they cost a few increments per
+ * transaction. */
+//#define TBMS_STATS
+
+#ifdef TBMS_STATS
+#define TBMS_STATS_DO(x) do { x; } while (0)
+#else
+#define TBMS_STATS_DO(x) do { } while (0)
+#endif
+
+#ifdef TBMS_STATS
+/* Bucket 0 counts 0 ms, bucket "i" 2^(i-1) .. 2^i - 1 ms, the last one
+ * everything above. */
+#define TBMS_STATS_BUCKETS 8
+
+//Task that sent the request
+enum tbms_stats_task {
+	TBMS_STATS_TASK_DISCOVER,
+	TBMS_STATS_TASK_SETUP_BOARDS,
+	TBMS_STATS_TASK_CLEAR_FAULTS,
+	TBMS_STATS_TASK_READ_STATUS,
+	TBMS_STATS_TASK_START_CONVERSION,
+	TBMS_STATS_TASK_READ_VALUES,
+	TBMS_STATS_TASK_BALANCE,
+	TBMS_STATS_TASK_PROBE,
+	TBMS_STATS_TASK_READ_BURST,
+	TBMS_STATS_TASKS
+};
+
+//Registers the library accesses (first register of request)
+enum tbms_stats_reg {
+	TBMS_STATS_REG_DEV_STATUS,
+	TBMS_STATS_REG_GPAI,
+	TBMS_STATS_REG_ALERT_STATUS,
+	TBMS_STATS_REG_FAULT_STATUS,
+	TBMS_STATS_REG_ADC_CTRL,
+	TBMS_STATS_REG_IO_CTRL,
+	TBMS_STATS_REG_BAL_CTRL,
+	TBMS_STATS_REG_BAL_TIME,
+	TBMS_STATS_REG_ADC_CONV,
+	TBMS_STATS_REG_ADDR_CTRL,
+	TBMS_STATS_REG_RESET,
+	TBMS_STATS_REG_OTHER,
+	TBMS_STATS_REGS
+};
+
+struct tbms_stats {
+	uint32_t tx_frames;
+	uint32_t tx_bytes;
+	uint32_t rx_bytes;
+
+	uint32_t timeouts;
+	uint32_t crc_errors;
+	uint32_t retries;     //Requests repeated (see TBMS_IO_RETRIES)
+	uint32_t rereads;     //Module tasks restarted (see TBMS_REREADS)
+	uint32_t bad_replies; //Valid CRC, but not what was asked for
+	uint32_t noise;       //Received bytes skipped, see tbms_io_rx_parse
+	uint32_t discoveries; //Connection established from scratch
+	uint32_t sweeps;
+
+	//Round trips (end of TX to complete reply)
+	uint32_t rtt_task[TBMS_STATS_TASKS][TBMS_STATS_BUCKETS];
+	uint32_t rtt_reg[TBMS_STATS_REGS][TBMS_STATS_BUCKETS];
+
+	/* Time between ends of consecutive sweeps, and its change (jitter).
+	 * With adaptive polling a sweep is one round of whatever reads are due
+	 * (see TBMS_POLL_FAST), so the period varies by design, from a few ms
+	 * (round cut short by a failure) up to TBMS_POLL_SLOW. Jitter follows
+	 * changes of module state as well as timing. */
+	clock_t  sweep_last; //tbms.time of last sweep end
+	clock_t  sweep_period;
+	clock_t  sweep_period_min;
+	clock_t  sweep_period_max;
+	uint32_t sweep_jitter[TBMS_STATS_BUCKETS];
+};
+
+void tbms_stats_init(struct tbms_stats *self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+uint8_t tbms_stats_bucket(clock_t ms)
+{
+	uint8_t i = 0;
+
+	while (ms > 0 && i < TBMS_STATS_BUCKETS - 1) {
+		ms >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+uint8_t tbms_stats_reg(uint8_t reg)
+{
+	switch (reg) {
+	case TBMS_REG_DEV_STATUS:   return TBMS_STATS_REG_DEV_STATUS;
+	case TBMS_REG_GPAI:         return TBMS_STATS_REG_GPAI;
+	case TBMS_REG_ALERT_STATUS: return TBMS_STATS_REG_ALERT_STATUS;
+	case TBMS_REG_FAULT_STATUS: return TBMS_STATS_REG_FAULT_STATUS;
+	case TBMS_REG_ADC_CTRL:     return TBMS_STATS_REG_ADC_CTRL;
+	case TBMS_REG_IO_CTRL:      return TBMS_STATS_REG_IO_CTRL;
+	case TBMS_REG_BAL_CTRL:     return TBMS_STATS_REG_BAL_CTRL;
+	case TBMS_REG_BAL_TIME:     return TBMS_STATS_REG_BAL_TIME;
+	case TBMS_REG_ADC_CONV:     return TBMS_STATS_REG_ADC_CONV;
+	case TBMS_REG_ADDR_CTRL:    return TBMS_STATS_REG_ADDR_CTRL;
+	case TBMS_REG_RESET:        return TBMS_STATS_REG_RESET;
+	default:                    return TBMS_STATS_REG_OTHER;
+	}
+}
+
+void tbms_stats_rtt(struct tbms_stats *self, uint8_t task, uint8_t reg,
+		    clock_t rtt)
+{
+	uint8_t b = tbms_stats_bucket(rtt);
+
+	self->rtt_task[task][b]++;
+	self->rtt_reg[tbms_stats_reg(reg)][b]++;
+}
+
+void tbms_stats_sweep(struct tbms_stats *self, clock_t time)
+{
+	clock_t period = time - self->sweep_last;
+
+	//First sweep after start or reconnect has no period
+	if (self->sweep_last && self->sweep_period) {
+		clock_t jitter = period > self->sweep_period ?
+				 period - self->sweep_period :
+				 self->sweep_period - period;
+
+		self->sweep_jitter[tbms_stats_bucket(jitter)]++;
+	}
+
+	if (self->sweep_last) {
+		if (!self->sweep_period_min || period < self->sweep_period_min)
+			self->sweep_period_min = period;
+		if (period > self->sweep_period_max)
+			self->sweep_period_max = period;
+
+		self->sweep_period = period;
+	}
+
+	self->sweep_last = time;
+	self->sweeps++;
+}
+#endif
+
+////////////////////////////////// FRAME TRACE ////////////////////////////////
+/* Binary recording of everything passing the library API: update deltas,
+ * TX frames, RX bytes and state transitions. Attach a ring with
+ * tbms_set_trace, drain it with tbms_trace_read (to a file, another UART,
+ * ...) and replay it later with tbms_trace.h. Compiled out unless defined,
+ * when enabled an update tick costs one byte and no formatting. */
+//#define TBMS_TRACE
+
+#ifdef TBMS_TRACE
+#define TBMS_TRACE_DO(x) do { x; } while (0)
+#else
+#define TBMS_TRACE_DO(x) do { } while (0)
+#endif
+
+/* Record is a header byte (type and argument), followed by data:
+ * UPDATE - argument is delta (ms), TBMS_TRACE_LONG: 32 bit delta follows (LE)
+ * TX     - argument is length, frame follows
+ * RX     - argument is length, received bytes follow
+ * STATE  - argument is IO state, library state follows */
+#define TBMS_TRACE_UPDATE 0x00
+#define TBMS_TRACE_TX     0x40
+#define TBMS_TRACE_RX     0x80
+#define TBMS_TRACE_STATE  0xC0
+
+#define TBMS_TRACE_TYPE(b) ((b) & 0xC0)
+#define TBMS_TRACE_ARG(b)  ((b) & 0x3F)
+#define TBMS_TRACE_LONG    0x3F
+
+#if TBMS_MAX_IO_BUF >= TBMS_TRACE_LONG
+#error "TX/RX frames do not fit trace record"
+#endif
+
+#ifdef TBMS_TRACE
+#ifndef TBMS_TRACE_BUF
+#define TBMS_TRACE_BUF 1024
+#endif
+
+/* Records are dropped (never overwritten) when ring is full. Trace with
+ * lost records can not be replayed past the loss. Drain it from the same
+ * context tbms_update runs in. */
+struct tbms_trace {
+	uint8_t buf[TBMS_TRACE_BUF];
+
+	size_t head; //Next byte to write
+	size_t tail; //Next byte to read
+
+	uint32_t lost; //Records
+
+	//Last recorded transition
+	uint8_t state;
+	uint8_t io_state;
+};
+
+void tbms_trace_init(struct tbms_trace *self)
+{
+	self->head = 0;
+	self->tail = 0;
+	self->lost = 0;
+
+	self->state    = 0xFF;
+	self->io_state = 0xFF;
+}
+
+size_t tbms_trace_free(struct tbms_trace *self)
+{
+	return (self->tail + TBMS_TRACE_BUF - self->head - 1) % TBMS_TRACE_BUF;
+}
+
+void tbms_trace_put(struct tbms_trace *self, uint8_t header,
+		    const uint8_t *data, size_t len)
+{
+	if (tbms_trace_free(self) < len + 1) {
+		self->lost++;
+		return;
+	}
+
+	self->buf[self->head] = header;
+	self->head = (self->head + 1) % TBMS_TRACE_BUF;
+
+	for (size_t i = 0; i < len; i++) {
+		self->buf[self->head] = data[i];
+		self->head = (self->head + 1) % TBMS_TRACE_BUF;
+	}
+}
+
+void tbms_trace_update(struct tbms_trace *self, clock_t delta)
+{
+	uint32_t d = (uint32_t)delta;
+	uint8_t  le[4] = { (uint8_t)d, (uint8_t)(d >> 8), (uint8_t)(d >> 16),
+			   (uint8_t)(d >> 24) };
+
+	if (d < TBMS_TRACE_LONG)
+		tbms_trace_put(self, (uint8_t)(TBMS_TRACE_UPDATE | d), NULL, 0);
+	else
+		tbms_trace_put(self, TBMS_TRACE_UPDATE | TBMS_TRACE_LONG,
+			       le, 4);
+}
+
+void tbms_trace_frame(struct tbms_trace *self, uint8_t type,
+		      const uint8_t *data, size_t len)
+{
+	if (len)
+		tbms_trace_put(self, (uint8_t)(type | len), data, len);
+}
+
+//Records transitions only
+void tbms_trace_state(struct tbms_trace *self, uint8_t state,
+		      uint8_t io_state)
+{
+	if (state == self->state && io_state == self->io_state)
+		return;
+
+	self->state    = state;
+	self->io_state = io_state;
+
+	tbms_trace_put(self, TBMS_TRACE_STATE | io_state, &state, 1);
+}
+
+//Moves up to "len" recorded bytes to "buf", returns their count
+size_t tbms_trace_read(struct tbms_trace *self, uint8_t *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len && self->tail != self->head) {
+		buf[n++] = self->buf[self->tail];
+		self->tail = (self->tail + 1) % TBMS_TRACE_BUF;
+	}
+
+	return n;
+}
+#endif
+
 ////////////////////// EVERYTHING RELATED TO INPUT/OUTPUT /////////////////////
 enum tbms_io_state {
 	TBMS_IO_STATE_IDLE,
 	TBMS_IO_STATE_WAIT_FOR_SEND,
 	TBMS_IO_STATE_WAIT_FOR_REPLY,
 	TBMS_IO_STATE_RX_DONE,
-	TBMS_IO_STATE_TIMEOUT
+	TBMS_IO_STATE_CRC_ERROR,
+	TBMS_IO_STATE_TIMEOUT,
+	TBMS_IO_STATE_BACKOFF //Waiting to repeat failed request
+};
+
+/* Failed request (timeout or CRC error) is repeated up to "max_retries"
+ * times, after TBMS_IO_BACKOFF ms, doubled for each next retry. */
+#define TBMS_IO_RETRIES 2
+#define TBMS_IO_BACKOFF 5
+
+#define TBMS_MAX_REQ_LEN 4 //Address, register, data/length and CRC
+
+/* Queued request. Reply of "expected_len" bytes is copied into "reply"
+ * (completion slot) when it arrives, if it is not NULL. Reply of the last
+ * request in queue always stays in tbms_io.buf as well. */
+struct tbms_io_req {
+	uint8_t  frame[TBMS_MAX_REQ_LEN];
+	uint8_t  len;
+	uint8_t  expected_len;
+	uint8_t *reply;
 };
 
 struct tbms_io {
 	enum tbms_io_state state;
 
-	async rx_state;
 	async tx_state;
 
 	bool ready;
 
 	uint8_t buf[TBMS_MAX_IO_BUF];
 	uint8_t len;
+	uint8_t expected_len;
+
+	struct tbms_io_req queue[TBMS_MAX_COMMANDS];
+	uint8_t queue_head;
+	uint8_t queue_len;
 	
 	clock_t timer;
 	clock_t timeout;
+
+	uint8_t retries;     //Of request at the head of queue
+	uint8_t max_retries; //0 disables retries
+
+#ifdef TBMS_STATS
+	struct tbms_stats *stats; //May be NULL
+	uint8_t stats_task; //enum tbms_stats_task of requests being sent
+#endif
 };
 
 void tbms_io_init(struct tbms_io *self)
 {
 	self->state = TBMS_IO_STATE_IDLE;
 	
-	self->rx_state = 0;
 	self->tx_state = 0;
 
 	self->ready = false;
 
 	//uint8_t buf[TBMS_MAX_IO_BUF];
 	self->len = 0;
+	self->expected_len = 0;
+
+	self->queue_head = 0;
+	self->queue_len  = 0;
 	
 	self->timer = 0;
 	self->timeout = 100;
+
+	self->retries     = 0;
+	self->max_retries = 0;
+
+#ifdef TBMS_STATS
+	self->stats = NULL;
+	self->stats_task = 0;
+#endif
+}
+
+//Drops everything in progress, configuration is kept
+void tbms_io_reset(struct tbms_io *self)
+{
+	uint8_t max_retries = self->max_retries;
+#ifdef TBMS_STATS
+	struct tbms_stats *stats = self->stats;
+#endif
+
+	tbms_io_init(self);
+
+	self->max_retries = max_retries;
+#ifdef TBMS_STATS
+	self->stats = stats;
+#endif
+}
+
+/* Checks CRC of a received frame (last byte). Modules set bit 7 of the
+ * address byte in their replies, this bit is not covered by CRC. */
+bool tbms_io_check_crc(uint8_t *buf, uint8_t len)
+{
+	uint8_t crc;
+
+	if (len < 2)
+		return false;
+
+	crc = tbms_crc_byte(0, buf[0] & 0x7F);
+
+	for (int i = 1; i < len - 1; i++)
+		crc = tbms_crc_byte(crc, buf[i]);
+
+	return crc == buf[len - 1];
+}
+
+//Moves request at the head of queue into buffer and waits for user to send
+void tbms_io_load_next(struct tbms_io *self)
+{
+	struct tbms_io_req *req = &self->queue[self->queue_head];
+
+	memcpy(self->buf, req->frame, req->len);
+	self->len = req->len;
+	self->expected_len = req->expected_len;
+
+	self->timer = 0;
+
+	self->ready = true;
+	self->state = TBMS_IO_STATE_WAIT_FOR_SEND;
+}
+
+/* Adds request to queue (CRC is appended for register write operations).
+ * Sending starts immediately if IO is not busy. Returns false if queue is
+ * full. */
+bool tbms_io_enqueue(struct tbms_io *self, uint8_t *data, uint8_t len,
+		     uint8_t expected_len, uint8_t *reply)
+{
+	struct tbms_io_req *req;
+
+	assert(len && len < TBMS_MAX_REQ_LEN);
+	assert(expected_len <= TBMS_MAX_IO_BUF);
+
+	if (self->queue_len >= TBMS_MAX_COMMANDS)
+		return false;
+
+	req = &self->queue[(self->queue_head + self->queue_len) %
+			   TBMS_MAX_COMMANDS];
+	memcpy(req->frame, data, len);
+
+	//Calculate CRC for register write operation
+	if (data[0] & TBMS_WRITE) {
+		req->frame[0] |= 1;
+		req->frame[len] = tbms_gen_crc(req->frame, len);
+
+		len++;
+	}
+
+	req->len = len;
+	req->expected_len = expected_len;
+	req->reply = reply;
+
+	if (self->queue_len++ == 0)
+		tbms_io_load_next(self);
+
+	return true;
+}
+
+//User has sent the frame, start waiting for reply
+void tbms_io_tx_done(struct tbms_io *self)
+{
+	if (self->state != TBMS_IO_STATE_WAIT_FOR_SEND)
+		return;
+
+	TBMS_STATS_DO(if (self->stats) {
+		self->stats->tx_frames++;
+		self->stats->tx_bytes += self->len;
+	});
+
+	self->len   = 0;
+	self->timer = 0;
+
+	self->ready = true;
+	self->state = TBMS_IO_STATE_WAIT_FOR_REPLY;
+}
+
+/* Complete reply (see tbms_io_rx_parse) goes to its completion slot and
+ * the next queued request is ready to be sent right away. */
+void tbms_io_rx_frame(struct tbms_io *self)
+{
+	struct tbms_io_req *req = &self->queue[self->queue_head];
+
+	self->ready = false;
+
+	self->retries = 0;
+
+	TBMS_STATS_DO(if (self->stats)
+		tbms_stats_rtt(self->stats, self->stats_task, req->frame[1],
+			       self->timer));
+
+	if (req->reply)
+		memcpy(req->reply, self->buf, self->len);
+
+	self->queue_head = (self->queue_head + 1) % TBMS_MAX_COMMANDS;
+	self->queue_len--;
+
+	if (self->queue_len)
+		tbms_io_load_next(self);
+	else
+		self->state = TBMS_IO_STATE_RX_DONE;
+}
+
+/* Returns true if "len" received bytes may start reply to "req". Reply
+ * repeats address (bit 7 set if module has none), register and value or
+ * length of the request. */
+bool tbms_io_rx_header(const uint8_t *buf, uint8_t len, const uint8_t *req)
+{
+	if (len > 0 && (buf[0] & 0x7F) != (req[0] & 0x7F))
+		return false;
+	if (len > 1 && buf[1] != req[1])
+		return false;
+	if (len > 2 && buf[2] != req[2])
+		return false;
+
+	return true;
+}
+
+//Offset of first byte from "from" that may start the reply, else "len"
+uint8_t tbms_io_rx_sync(struct tbms_io *self, uint8_t from)
+{
+	const uint8_t *req = self->queue[self->queue_head].frame;
+
+	while (from < self->len && !tbms_io_rx_header(&self->buf[from],
+						      self->len - from, req))
+		from++;
+
+	return from;
+}
+
+//Drops "n" bytes from the start of receive buffer
+void tbms_io_rx_skip(struct tbms_io *self, uint8_t n)
+{
+	if (!n)
+		return;
+
+	TBMS_STATS_DO(if (self->stats) self->stats->noise += n);
+
+	memmove(self->buf, &self->buf[n], self->len - n);
+	self->len -= n;
+}
+
+/* Finds reply to the request at the head of queue in received bytes, so a
+ * stray or lost byte costs one frame, not every frame after it. Bytes that
+ * can not start the reply are noise and skipped. Reply has "expected_len"
+ * bytes ending with CRC, except a read from address 0 that no module
+ * answered (3 byte echo, bit 7 clear). A frame with bad CRC is skipped if
+ * a later byte may start the reply (e.g. rest of a truncated frame came
+ * first), otherwise IO stays in TBMS_IO_STATE_CRC_ERROR until it is reset
+ * (treated as timeout). */
+void tbms_io_rx_parse(struct tbms_io *self)
+{
+	const uint8_t *req = self->queue[self->queue_head].frame;
+	uint8_t frame_len, next;
+
+	for (;;) {
+		tbms_io_rx_skip(self, tbms_io_rx_sync(self, 0));
+
+		if (self->len < 3)
+			return;
+
+		frame_len = req[0] == TBMS_READ && !(self->buf[0] & 0x80) ?
+			    3 : self->expected_len;
+
+		if (self->len < frame_len)
+			return;
+
+		if (frame_len < 4 || tbms_io_check_crc(self->buf, frame_len))
+			break;
+
+		next = tbms_io_rx_sync(self, 1);
+
+		if (next >= self->len) {
+			TBMS_STATS_DO(if (self->stats)
+				self->stats->crc_errors++);
+
+			self->ready = false;
+			self->state = TBMS_IO_STATE_CRC_ERROR;
+			return;
+		}
+
+		tbms_io_rx_skip(self, next);
+	}
+
+	//Anything after the frame is not part of it
+	TBMS_STATS_DO(if (self->stats)
+		self->stats->noise += self->len - frame_len);
+
+	self->len = frame_len;
+
+	tbms_io_rx_frame(self);
+}
+
+/* Where next reply bytes go and how many are still expected ("len"), so
+ * they can be read straight into IO buffer. NULL if no reply is expected. */
+uint8_t *tbms_io_rx_space(struct tbms_io *self, size_t *len)
+{
+	if (self->state != TBMS_IO_STATE_WAIT_FOR_REPLY) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = self->expected_len - self->len;
+
+	return &self->buf[self->len];
+}
+
+//"n" bytes were placed at tbms_io_rx_space
+void tbms_io_rx_commit(struct tbms_io *self, size_t n)
+{
+	assert(self->len + n <= self->expected_len);
+
+	self->len += (uint8_t)n;
+
+	TBMS_STATS_DO(if (self->stats) self->stats->rx_bytes += n);
+
+	tbms_io_rx_parse(self);
+}
+
+/* Appends as many bytes of "data" as current reply still needs.
+ * Returns number of bytes used. */
+size_t tbms_io_rx(struct tbms_io *self, const uint8_t *data, size_t len)
+{
+	size_t n;
+	uint8_t *dst = tbms_io_rx_space(self, &n);
+
+	if (!dst)
+		return 0;
+
+	if (n > len)
+		n = len;
+
+	memcpy(dst, data, n);
+	tbms_io_rx_commit(self, n);
+
+	return n;
+}
+
+//Returns true once every queued request got its reply
+bool tbms_io_done(struct tbms_io *self)
+{
+	return !self->queue_len && self->state == TBMS_IO_STATE_RX_DONE;
+}
+
+/* Sends "data" of "len". Waits for module response of "expected_len" bytes.
+ * Reply is left in buffer. (For batches see tbms_io_enqueue)
+ * returns false until all conditions are met. */
+bool tbms_io_send(struct tbms_io *self, uint8_t *data, uint8_t len,
+		  uint8_t expected_len)
+{
+	ASYNC_DISPATCH(self->tx_state);
+
+	if (!tbms_io_enqueue(self, data, len, expected_len, NULL))
+		assert(!"tbms_io queue is full");
+
+	ASYNC_AWAIT(tbms_io_done(self), return false);
+	ASYNC_YIELD(return false); //To track state change
+
+	self->state = TBMS_IO_STATE_IDLE;
+
+	ASYNC_RESET(return true);
+}
+
+/* Waits for all queued requests (see tbms_io_enqueue)
+ * returns false until all conditions are met. */
+bool tbms_io_flush(struct tbms_io *self)
+{
+	ASYNC_DISPATCH(self->tx_state);
+
+	ASYNC_AWAIT(tbms_io_done(self), return false);
+	ASYNC_YIELD(return false); //To track state change
+
+	self->state = TBMS_IO_STATE_IDLE;
+
+	ASYNC_RESET(return true);
+}
+
+bool tbms_io_validate_reply(struct tbms_io *self, uint8_t *reply, uint8_t len)
+{
+	if (!memcmp(self->buf, reply, len))
+		return true;
+	else
+		return false;
+}
+
+void tbms_io_update(struct tbms_io *self)
+{
+	bool failed = false;
+
+	if (self->state == TBMS_IO_STATE_TIMEOUT)
+		tbms_io_reset(self);
+
+	//Same request again, anything left of the failed reply is stale
+	if (self->state == TBMS_IO_STATE_BACKOFF) {
+		if (self->timer >= (clock_t)TBMS_IO_BACKOFF << (self->retries - 1))
+			tbms_io_load_next(self);
+
+		return;
+	}
+
+	/* Timeout is counted while waiting for reply, and for frame to be sent,
+	 * so a port that can not send (hangup, full) ends up as timeout too */
+	if (self->state != TBMS_IO_STATE_WAIT_FOR_REPLY &&
+	    self->state != TBMS_IO_STATE_WAIT_FOR_SEND)
+		self->timer = 0;
+
+	//CRC errors are handled exactly as timeouts (but counted apart)
+	if (self->timer >= self->timeout) {
+		TBMS_STATS_DO(if (self->stats) self->stats->timeouts++);
+
+		failed = true;
+	} else if (self->state == TBMS_IO_STATE_CRC_ERROR) {
+		failed = true;
+	}
+
+	if (!failed)
+		return;
+
+	if (self->retries < self->max_retries) {
+		TBMS_STATS_DO(if (self->stats) self->stats->retries++);
+
+		self->retries++;
+
+		self->len   = 0;
+		self->timer = 0;
+		self->ready = false;
+		self->state = TBMS_IO_STATE_BACKOFF;
+	} else {
+		self->state = TBMS_IO_STATE_TIMEOUT;
+	}
+}
+
+//////////////////// DEBUG ////////////////////
+/* IO transitions and TX/RX frames are appended as fixed size binary
+ * records to a lock-free single producer, single consumer ring (see
+ * tbms_set_log). Formatting happens in tbms_log_drain, which may run in
+ * another thread or a low priority task, so tbms_update only pays for a
+ * record copy. Compiled out unless TBMS_DEBUG is defined. */
+
+#ifdef TBMS_DEBUG
+#define TBMS_DEBUG_DO(x) do { x; } while (0)
+#else
+#define TBMS_DEBUG_DO(x) do { } while (0)
+#endif
+
+#ifdef   TBMS_DEBUG
+//Power of two
+#ifndef TBMS_LOG_RECORDS
+#define TBMS_LOG_RECORDS 32
+#endif
+
+enum tbms_log_type {
+	TBMS_LOG_IO_STATE, //data: previous and new state
+	TBMS_LOG_TX,       //data: frame
+	TBMS_LOG_RX        //data: received reply
+};
+
+struct tbms_log_rec {
+	clock_t time; //tbms.time
+	uint8_t type;
+	uint8_t len;
+	uint8_t data[TBMS_MAX_IO_BUF];
+};
+
+struct tbms_log {
+	struct tbms_log_rec rec[TBMS_LOG_RECORDS];
+
+	//Free running, "head" is written by producer only, "tail" by consumer
+	uint32_t head;
+	uint32_t tail;
+
+	//Producer side
+	uint32_t lost;    //Records, ring was full
+	uint8_t io_state; //Last logged
+};
+
+const char *tbms_io_get_state_name(uint8_t state)
+{
+	switch (state) {
+	case TBMS_IO_STATE_IDLE:            return "IDLE";
+	case TBMS_IO_STATE_WAIT_FOR_SEND:   return "WAIT_FOR_SEND";
+	case TBMS_IO_STATE_WAIT_FOR_REPLY:  return "WAIT_FOR_REPLY";
+	case TBMS_IO_STATE_RX_DONE:         return "RX_DONE";
+	case TBMS_IO_STATE_CRC_ERROR:       return "CRC_ERROR";
+	case TBMS_IO_STATE_TIMEOUT:         return "TIMEOUT";
+	case TBMS_IO_STATE_BACKOFF:         return "BACKOFF";
+	}
+	
+	return NULL;
+}
+
+void tbms_log_init(struct tbms_log *self)
+{
+	self->head = 0;
+	self->tail = 0;
+	self->lost = 0;
+
+	self->io_state = TBMS_IO_STATE_IDLE;
+}
+
+//Producer: returns free record to fill in, or NULL if ring is full
+struct tbms_log_rec *tbms_log_claim(struct tbms_log *self)
+{
+	uint32_t tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+
+	if (self->head - tail >= TBMS_LOG_RECORDS) {
+		self->lost++;
+		return NULL;
+	}
+
+	return &self->rec[self->head % TBMS_LOG_RECORDS];
+}
+
+//Producer: makes claimed record visible to consumer
+void tbms_log_publish(struct tbms_log *self)
+{
+	__atomic_store_n(&self->head, self->head + 1, __ATOMIC_RELEASE);
+}
+
+void tbms_log_push(struct tbms_log *self, clock_t time, uint8_t type,
+		   const uint8_t *data, uint8_t len)
+{
+	struct tbms_log_rec *rec = tbms_log_claim(self);
+
+	if (!rec)
+		return;
+
+	rec->time = time;
+	rec->type = type;
+	rec->len  = len;
+	memcpy(rec->data, data, len);
+
+	tbms_log_publish(self);
+}
+
+//Called at the end of each update
+void tbms_log_io(struct tbms_log *self, clock_t time, struct tbms_io *io)
+{
+	if (io->state != self->io_state) {
+		uint8_t t[2] = { self->io_state, (uint8_t)io->state };
+
+		tbms_log_push(self, time, TBMS_LOG_IO_STATE, t, 2);
+		self->io_state = (uint8_t)io->state;
+	}
+
+	if (io->state == TBMS_IO_STATE_WAIT_FOR_SEND && io->ready)
+		tbms_log_push(self, time, TBMS_LOG_TX, io->buf, io->len);
+
+	if (io->state == TBMS_IO_STATE_RX_DONE ||
+	    io->state == TBMS_IO_STATE_TIMEOUT)
+		tbms_log_push(self, time, TBMS_LOG_RX, io->buf, io->len);
+}
+
+//Consumer: takes oldest record, returns false if there is none
+bool tbms_log_pop(struct tbms_log *self, struct tbms_log_rec *rec)
+{
+	uint32_t head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+
+	if (self->tail == head)
+		return false;
+
+	memcpy(rec, &self->rec[self->tail % TBMS_LOG_RECORDS], sizeof(*rec));
+
+	__atomic_store_n(&self->tail, self->tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* Formats record as one line of text. Returns its length, it was cut if
+ * not less than "size". */
+size_t tbms_log_format(const struct tbms_log_rec *rec, char *buf, size_t size)
+{
+	size_t n;
+
+	if (rec->type == TBMS_LOG_IO_STATE)
+		return (size_t)snprintf(buf, size,
+					"[% 3i] tbms.io.state: %s -> %s\n",
+					(int)rec->time,
+					tbms_io_get_state_name(rec->data[0]),
+					tbms_io_get_state_name(rec->data[1]));
+
+	n = (size_t)snprintf(buf, size, "[% 3i] tbms.io.%s: ", (int)rec->time,
+			     rec->type == TBMS_LOG_TX ? "txbuf" : "rxbuf");
+
+	for (uint8_t i = 0; i < rec->len && n < size; i++)
+		n += (size_t)snprintf(buf + n, size - n, "0x%02X ",
+				      rec->data[i]);
+
+	if (n < size)
+		n += (size_t)snprintf(buf + n, size - n, "\n");
+
+	return n;
+}
+
+/* Consumer: formats up to "max" records to "f" (0 for all of them).
+ * Returns number of records written. */
+size_t tbms_log_drain(struct tbms_log *self, FILE *f, size_t max)
+{
+	struct tbms_log_rec rec;
+	char line[32 + TBMS_MAX_IO_BUF * 5];
+	size_t n = 0;
+
+	while ((!max || n < max) && tbms_log_pop(self, &rec)) {
+		tbms_log_format(&rec, line, sizeof(line));
+		fputs(line, f);
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+//////////////////////////// TESLA BMS MAIN INSTANCE //////////////////////////
+enum tbms_task_event { //Events returned by tasks
+	TBMS_TASK_EVENT_NONE, //No event, keep running
+	TBMS_TASK_EVENT_EXIT_OK,
+	TBMS_TASK_EVENT_EXIT_FAULT
+};
+
+enum tbms_state {
+	TBMS_STATE_INIT,
+	TBMS_STATE_ESTABLISH_CONNECTION,
+	TBMS_STATE_CONNECTION_ESTABLISHED
+};
+
+/* Once connection is established, a request that failed even after IO
+ * retries restarts the task of current module. After this many restarts
+ * without a complete sweep the chain is discovered again. */
+#define TBMS_REREADS 2
+
+#define TBMS_MODULE_CELLS 6
+
+/* Module data, structure of arrays indexed by module id (address - 1).
+ * Pack wide scans only touch the array they need. */
+struct tbms_modules {
+	uint64_t exist; //bit per module
+
+	/* Bit per module with any fault, COV or CUV bit set (or which status
+	 * was not read yet). "fault_summary" is OR of TBMS_FAULT_SUMMARY() of
+	 * all those modules. */
+	uint64_t faulted;
+	uint32_t fault_summary;
+
+	tbms_volt_t cell[TBMS_MAX_MODULES][TBMS_MODULE_CELLS];
+	tbms_volt_t voltage[TBMS_MAX_MODULES];
+	tbms_temp_t temp[TBMS_MAX_MODULES][2];
+
+	//bit 0-5 are to activate cell balancing 1-6
+	uint8_t balance_bits[TBMS_MAX_MODULES];
+
+	uint8_t alerts[TBMS_MAX_MODULES];
+	uint8_t faults[TBMS_MAX_MODULES];
+
+	//Cell overvoltage and undervoltage faults
+	uint8_t cov_faults[TBMS_MAX_MODULES];
+	uint8_t cuv_faults[TBMS_MAX_MODULES];
+
+	//Last values written to registers (see TBMS_SHADOW_FIRST)
+	uint8_t shadow[TBMS_MAX_MODULES][TBMS_SHADOW_REGS];
+	uint8_t shadow_valid[TBMS_MAX_MODULES]; //bit per register
+
+	//When balance timer was started (see tbms.time)
+	clock_t bal_armed[TBMS_MAX_MODULES];
+
+	/* Balancing duty: ms each cell was balanced out of "duty_total" ms,
+	 * accounted when balancing is evaluated ("duty_eval"). */
+	clock_t  duty_eval[TBMS_MAX_MODULES];
+	uint16_t duty_total[TBMS_MAX_MODULES];
+	uint16_t duty_on[TBMS_MAX_MODULES][TBMS_MODULE_CELLS];
+
+	//Sum of raw cell ADC counts (see tbms_pack)
+	uint32_t cell_sum[TBMS_MAX_MODULES];
+
+	/* Polling: values (status) are due "values_every" ("status_every")
+	 * ms after they were read at "values_at" ("status_at"). */
+	clock_t  values_at[TBMS_MAX_MODULES];
+	clock_t  status_at[TBMS_MAX_MODULES];
+	uint16_t values_every[TBMS_MAX_MODULES];
+	uint16_t status_every[TBMS_MAX_MODULES];
+};
+
+#define TBMS_MODULE_BIT(id) ((uint64_t)1 << (id))
+
+//FAULT_STATUS in bits 0-7, COV_FAULT in bits 8-15, CUV_FAULT in 16-23
+#define TBMS_FAULT_SUMMARY(m, id) ((uint32_t)(m)->faults[id] | \
+				   ((uint32_t)(m)->cov_faults[id] << 8) | \
+				   ((uint32_t)(m)->cuv_faults[id] << 16))
+#define TBMS_PACK_NONE      0xFF
+
+/* Pack wide aggregates, updated each time module values are decoded.
+ * Extremes keep their value as well, so they can be compared with new
+ * values of the same module. */
+struct tbms_pack {
+	uint64_t valid;    //Modules which values were read at least once
+	uint32_t cell_sum; //Raw ADC counts, exact in both float and fixed mode
+
+	tbms_volt_t cell_min, cell_max;
+	uint8_t cell_min_id, cell_min_cn; //TBMS_PACK_NONE if unknown
+	uint8_t cell_max_id, cell_max_cn;
+
+	tbms_temp_t temp_min, temp_max;
+	uint8_t temp_min_id, temp_max_id;
+};
+
+//////////////////// SNAPSHOT ////////////////////
+/* Module data is written piece by piece during a sweep, so a reader in
+ * another thread may see a half updated pack. With TBMS_SNAPSHOT, a copy
+ * is published to "struct tbms_snapshot_buf" (see tbms_set_snapshot) at
+ * the end of each sweep and when connection is lost. Publication is a
+ * seqlock: the single writer (tbms_update) never waits, any number of
+ * readers copy it out lock-free with tbms_snapshot_read and retry if it
+ * changed meanwhile. */
+//#define TBMS_SNAPSHOT
+
+#ifdef TBMS_SNAPSHOT
+#define TBMS_SNAPSHOT_DO(x) do { x; } while (0)
+#else
+#define TBMS_SNAPSHOT_DO(x) do { } while (0)
+#endif
+
+#ifdef TBMS_SNAPSHOT
+struct tbms_snapshot {
+	uint32_t sweep; //Complete sweeps since tbms_init, 0 if none yet
+	clock_t  time;  //tbms.time of publication
+	bool     ready; //tbms_is_ready
+
+	uint64_t exist;   //Bit per module
+	uint64_t faulted; //See struct tbms_modules
+	uint32_t fault_summary;
+	uint8_t  modules_count;
+
+	tbms_volt_t cell[TBMS_MAX_MODULES][TBMS_MODULE_CELLS];
+	tbms_volt_t voltage[TBMS_MAX_MODULES];
+	tbms_temp_t temp[TBMS_MAX_MODULES][2];
+	clock_t     values_at[TBMS_MAX_MODULES]; //tbms.time values were read
+
+	uint8_t balance_bits[TBMS_MAX_MODULES];
+	uint8_t alerts[TBMS_MAX_MODULES];
+	uint8_t faults[TBMS_MAX_MODULES];
+	uint8_t cov_faults[TBMS_MAX_MODULES];
+	uint8_t cuv_faults[TBMS_MAX_MODULES];
+
+	struct tbms_pack pack;
+};
+
+struct tbms_snapshot_buf {
+	uint32_t seq; //Odd while being written, 0 until first publication
+
+	struct tbms_snapshot snap;
+};
+
+void tbms_snapshot_init(struct tbms_snapshot_buf *self)
+{
+	self->seq = 0;
+}
+
+//Writer: "snap" may only be changed between begin and end
+void tbms_snapshot_begin(struct tbms_snapshot_buf *self)
+{
+	__atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void tbms_snapshot_end(struct tbms_snapshot_buf *self)
+{
+	__atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Reader: copies last published snapshot to "out", from any thread.
+ * Returns false if nothing was published yet. */
+bool tbms_snapshot_read(struct tbms_snapshot_buf *self,
+			struct tbms_snapshot *out)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&self->seq, __ATOMIC_ACQUIRE);
+
+		if (!seq)
+			return false;
+
+		//Writer is in the middle of it
+		if (seq & 1)
+			continue;
+
+		memcpy(out, &self->snap, sizeof(*out));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&self->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+}
+
+float tbms_snapshot_get_cell_voltage(const struct tbms_snapshot *self,
+				     uint8_t id, uint8_t cn)
+{
+	if (id >= TBMS_MAX_MODULES || cn >= TBMS_MODULE_CELLS ||
+	    !(self->exist & ((uint64_t)1 << id)))
+		return NAN;
+
+	return TBMS_CELL_TO_F(self->cell[id][cn]);
+}
+
+float tbms_snapshot_get_pack_voltage(const struct tbms_snapshot *self)
+{
+	if (!self->pack.valid)
+		return NAN;
+
+	return self->pack.cell_sum * TBMS_CELL_LSB;
+}
+#endif
+
+struct tbms
+{
+	enum tbms_state state;
+
+	async async_state;
+	async async_task_state;
+
+	enum tbms_task_event (**current_task)(struct tbms *self);
+	
+	struct tbms_io io;
+
+	struct tbms_modules modules;
+	struct tbms_pack    pack;
+	uint8_t modules_count;
+	uint8_t mod_sel;
+	uint8_t rereads; //Since last complete sweep
+
+	//Modules to read in current round (see tbms_poll_due)
+	uint64_t poll_values;
+	uint64_t poll_status;
+	clock_t  poll_start; //Of current round, modules read in it stay aligned
+
+	/* Modules (bit per id) of last established connection, they are
+	 * probed before the chain is discovered ("warm" start). */
+	uint64_t topology;
+	bool warm;
+
+	/* Cells above "bal_voltage" and more than "bal_hyst" above lowest cell
+	 * of the whole pack are balanced. */
+	tbms_volt_t bal_voltage;
+	tbms_volt_t bal_hyst;
+
+#ifdef TBMS_STATS
+	struct tbms_stats stats;
+#endif
+
+#ifdef TBMS_TRACE
+	struct tbms_trace *trace; //May be NULL
+#endif
+
+#ifdef TBMS_DEBUG
+	struct tbms_log *log; //May be NULL
+#endif
+
+#ifdef TBMS_SNAPSHOT
+	struct tbms_snapshot_buf *snapshot; //May be NULL
+#endif
+
+	uint32_t sweeps; //Complete sweeps since tbms_init
+	
+	clock_t timer;
+	clock_t sleep; //State machine waits for "timer" to reach it, 0 if busy
+	clock_t time;  //Since tbms_init
+
+	bool ready;
+};
+
+bool tbms_module_exists(struct tbms *self, uint8_t id)
+{
+	return (self->modules.exist & TBMS_MODULE_BIT(id)) != 0;
+}
+
+void tbms_modules_init(struct tbms *self)
+{
+	struct tbms_modules *m = &self->modules;
+
+	m->exist = 0;
+
+	m->faulted = 0;
+	m->fault_summary = 0;
+
+	for (int i = 0; i < TBMS_MAX_MODULES; i++) {
+		m->voltage[i] = 0;
+
+		m->temp[i][0] = 0;
+		m->temp[i][1] = 0;
+
+		m->balance_bits[i] = 0;
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++) {
+			m->cell[i][j]    = TBMS_CELL_UNKNOWN;
+			m->duty_on[i][j] = 0;
+		}
+		
+		m->alerts[i] = 0xFF;
+		m->faults[i] = 0xFF;
+
+		m->cov_faults[i] = 0xFF;
+		m->cuv_faults[i] = 0xFF;
+
+		m->shadow_valid[i] = 0;
+		m->bal_armed[i] = 0;
+
+		m->duty_eval[i]  = self->time;
+		m->duty_total[i] = 0;
+
+		//Everything is due right away
+		m->values_at[i]    = self->time;
+		m->status_at[i]    = self->time;
+		m->values_every[i] = 0;
+		m->status_every[i] = 0;
+	}
+
+	self->pack.valid    = 0;
+	self->pack.cell_sum = 0;
+
+	self->pack.cell_min_id = TBMS_PACK_NONE;
+	self->pack.cell_max_id = TBMS_PACK_NONE;
+	self->pack.temp_min_id = TBMS_PACK_NONE;
+	self->pack.temp_max_id = TBMS_PACK_NONE;
+
+	self->modules_count = 0;
+	self->mod_sel = 0;
+	self->rereads = 0;
 }
 
-void tbms_io_reset(struct tbms_io *self)
+void tbms_init(struct tbms *self)
 {
-	tbms_io_init(self);
-}
+	self->state = TBMS_STATE_INIT;
 
-/* Waits for module data of "expected_len" bytes
- * returns false until all conditions are met. 
- * TODO ADD CRC CHECKS. */
-bool tbms_io_recv(struct tbms_io *self, uint8_t expected_len)
-{
-	ASYNC_DISPATCH(self->rx_state);
+	self->async_state      = 0;
+	self->async_task_state = 0;
+
+	self->current_task = NULL;
+
+	tbms_io_init(&self->io);
+
+	TBMS_STATS_DO(tbms_stats_init(&self->stats);
+		      self->io.stats = &self->stats);
+
+	TBMS_TRACE_DO(self->trace = NULL);
+	TBMS_DEBUG_DO(self->log = NULL);
+	TBMS_SNAPSHOT_DO(self->snapshot = NULL);
+
+	self->sweeps = 0;
 
-	self->ready = false;
-	self->len   = 0;
 	self->timer = 0;
+	self->sleep = 0;
+	self->time  = 0;
 
-	self->state = TBMS_IO_STATE_WAIT_FOR_REPLY;
-	ASYNC_AWAIT((self->ready = true, self->len) >= expected_len,
-		    return false);
-	self->state = TBMS_IO_STATE_RX_DONE;
-	ASYNC_YIELD(return false); //To track state change
+	tbms_modules_init(self);
 
-	self->state = TBMS_IO_STATE_IDLE;
+	self->topology = 0;
+	self->warm     = false;
 
-	ASYNC_RESET(return true);
+	self->bal_voltage = TBMS_VOLTS(TBMS_BALANCE_VOLTAGE);
+	self->bal_hyst    = TBMS_VOLTS(TBMS_BALANCE_HYST);
+
+	self->ready = false;
 }
 
-/* Sends "data" of "len". Waits for module response (see tbms_io_recv)
- * returns false until all conditions are met. */
-bool tbms_io_send(struct tbms_io *self, uint8_t *data, uint8_t len,
-		  uint8_t expected_len)
+//////////////////// REGISTER SHADOW ////////////////////
+/* Writes of values that are already in module registers are skipped.
+ * "addr" is either TBMS_BROADCAST (all modules) or module address byte. */
+void tbms_shadow_invalidate(struct tbms *self)
 {
-	ASYNC_DISPATCH(self->tx_state);
-	
-	assert(len && len < TBMS_MAX_IO_BUF);
-	memcpy(self->buf, data, len);
-	
-	//Calculate CRC for register write operation
-	if (data[0] & TBMS_WRITE) {
-		self->buf[0] |= 1;
-		self->buf[len] = tbms_gen_crc(self->buf, len);
+	for (int i = 0; i < TBMS_MAX_MODULES; i++)
+		self->modules.shadow_valid[i] = 0;
+}
 
-		len++;
-	}
+bool tbms_shadow_match(struct tbms *self, uint8_t addr, uint8_t reg,
+		       uint8_t val)
+{
+	uint8_t r = reg - TBMS_SHADOW_FIRST;
+	int i   = (addr == TBMS_BROADCAST) ? 0 : (addr >> 1) - 1;
+	int end = (addr == TBMS_BROADCAST) ? TBMS_MAX_MODULES : i + 1;
+	struct tbms_modules *m = &self->modules;
 
-	self->ready = true;
-	self->len = len;
-	self->timer = 0;
+	assert(r < TBMS_SHADOW_REGS && end <= TBMS_MAX_MODULES);
 
-	self->state = TBMS_IO_STATE_WAIT_FOR_SEND;
-	ASYNC_AWAIT(!self->ready, return false); //Wait for user to send
-	self->len = 0;
+	for (; i < end; i++) {
+		if (!tbms_module_exists(self, i))
+			continue;
 
-	ASYNC_AWAIT(tbms_io_recv(self, expected_len), return false);
-	
-	self->state = TBMS_IO_STATE_IDLE;
+		if (!(m->shadow_valid[i] & (1 << r)) || m->shadow[i][r] != val)
+			return false;
+	}
 
-	ASYNC_RESET(return true);
+	return true;
 }
 
-/* If you want to interrupt tbms_io_send before expected_len has arrived
- * Call this command and RX will be done (as well as TX); */
-bool tbms_io_rx_done(struct tbms_io *self)
+void tbms_shadow_set(struct tbms *self, uint8_t addr, uint8_t reg,
+		     uint8_t val)
 {
-	if (!self->rx_state)
-		return true;
+	uint8_t r = reg - TBMS_SHADOW_FIRST;
+	int i   = (addr == TBMS_BROADCAST) ? 0 : (addr >> 1) - 1;
+	int end = (addr == TBMS_BROADCAST) ? TBMS_MAX_MODULES : i + 1;
 
-	// Also stop TX
-	self->tx_state = 0;
-	self->rx_state = 0;
+	assert(r < TBMS_SHADOW_REGS && end <= TBMS_MAX_MODULES);
 
-	self->state = TBMS_IO_STATE_RX_DONE;
-	
-	return false;
+	for (; i < end; i++) {
+		self->modules.shadow[i][r] = val;
+		self->modules.shadow_valid[i] |= (1 << r);
+	}
 }
 
-bool tbms_io_validate_reply(struct tbms_io *self, uint8_t *reply, uint8_t len)
+//////////////////// FAULTS ////////////////////
+//Call after fault registers of module "id" changed
+void tbms_faults_update(struct tbms *self, uint8_t id)
 {
-	if (!memcmp(self->buf, reply, len))
-		return true;
+	struct tbms_modules *m = &self->modules;
+	uint64_t faulted = m->faulted;
+
+	if (TBMS_FAULT_SUMMARY(m, id))
+		m->faulted |=  TBMS_MODULE_BIT(id);
 	else
-		return false;
+		m->faulted &= ~TBMS_MODULE_BIT(id);
+
+	//Nothing was and nothing is faulted, summary stays zero
+	if (!faulted && !m->faulted)
+		return;
+
+	m->fault_summary = 0;
+
+	for (int i = 0; i < TBMS_MAX_MODULES; i++)
+		if (m->faulted & TBMS_MODULE_BIT(i))
+			m->fault_summary |= TBMS_FAULT_SUMMARY(m, i);
 }
 
-void tbms_io_update(struct tbms_io *self)
+//////////////////// PACK STATISTICS ////////////////////
+void tbms_pack_put_cell(struct tbms_pack *p, uint8_t id, uint8_t cn,
+			tbms_volt_t v)
 {
-	if (self->state == TBMS_IO_STATE_TIMEOUT)
-		tbms_io_reset(self);
-		
-	if (!self->rx_state || !self->tx_state)
-		self->timer = 0;
+	if (p->cell_min_id == TBMS_PACK_NONE || v < p->cell_min) {
+		p->cell_min    = v;
+		p->cell_min_id = id;
+		p->cell_min_cn = cn;
+	}
 
-	if (self->timer >= self->timeout)
-		self->state = TBMS_IO_STATE_TIMEOUT;
+	if (p->cell_max_id == TBMS_PACK_NONE || v > p->cell_max) {
+		p->cell_max    = v;
+		p->cell_max_id = id;
+		p->cell_max_cn = cn;
+	}
 }
 
-//////////////////// DEBUG ////////////////////
-#ifdef   TBMS_DEBUG
-const char *tbms_io_get_state_name(uint8_t state)
+void tbms_pack_put_temp(struct tbms_pack *p, uint8_t id, tbms_temp_t t)
 {
-	switch (state) {
-	case TBMS_IO_STATE_IDLE:            return "IDLE";
-	case TBMS_IO_STATE_WAIT_FOR_SEND:   return "WAIT_FOR_SEND";
-	case TBMS_IO_STATE_WAIT_FOR_REPLY:  return "WAIT_FOR_REPLY";
-	case TBMS_IO_STATE_RX_DONE:         return "RX_DONE";
-	case TBMS_IO_STATE_TIMEOUT:         return "TIMEOUT";
+	if (!TBMS_TEMP_VALID(t))
+		return;
+
+	if (p->temp_min_id == TBMS_PACK_NONE || t < p->temp_min) {
+		p->temp_min    = t;
+		p->temp_min_id = id;
 	}
-	
-	return NULL;
-}
-#endif
 
-//////////////////////////// TESLA BMS MAIN INSTANCE //////////////////////////
-enum tbms_task_event { //Events returned by tasks
-	TBMS_TASK_EVENT_NONE, //No event, keep running
-	TBMS_TASK_EVENT_EXIT_OK,
-	TBMS_TASK_EVENT_EXIT_FAULT
-};
+	if (p->temp_max_id == TBMS_PACK_NONE || t > p->temp_max) {
+		p->temp_max    = t;
+		p->temp_max_id = id;
+	}
+}
 
-enum tbms_state {
-	TBMS_STATE_INIT,
-	TBMS_STATE_ESTABLISH_CONNECTION,
-	TBMS_STATE_CONNECTION_ESTABLISHED
-};
+//Full scan, only needed when extreme value of a module moved inwards
+void tbms_pack_scan(struct tbms *self)
+{
+	struct tbms_modules *m = &self->modules;
+	struct tbms_pack    *p = &self->pack;
 
-struct tbms_module_cell {
-	float voltage;
-	bool  balance; /* If cell needs to be balanced or not. */
-};
+	p->cell_min_id = p->cell_max_id = TBMS_PACK_NONE;
+	p->temp_min_id = p->temp_max_id = TBMS_PACK_NONE;
 
-struct tbms_module {
-	bool exist;
+	for (int i = 0; i < TBMS_MAX_MODULES; i++) {
+		if (!(p->valid & TBMS_MODULE_BIT(i)))
+			continue;
 
-	float voltage;
-	
-	float  temp1;
-	float  temp2;
+		for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+			tbms_pack_put_cell(p, i, j, m->cell[i][j]);
 
-	struct tbms_module_cell cell[6];
-	uint8_t balance_bits;
-	
-	uint8_t alerts;
-	uint8_t faults;
+		tbms_pack_put_temp(p, i, m->temp[i][0]);
+		tbms_pack_put_temp(p, i, m->temp[i][1]);
+	}
+}
 
-	//Cell overvoltage and undervoltage faults
-	uint8_t cov_faults;
-	uint8_t cuv_faults;
-};
+/* Call after new values of module "id" were stored. "cell_sum" is sum of
+ * its raw cell ADC counts. Whole pack is only rescanned if an extreme was
+ * in this module and its new values are not as extreme anymore. */
+void tbms_pack_update(struct tbms *self, uint8_t id, uint32_t cell_sum)
+{
+	struct tbms_modules *m = &self->modules;
+	struct tbms_pack    *p = &self->pack;
+	tbms_temp_t *t = m->temp[id];
+
+	if (p->valid & TBMS_MODULE_BIT(id))
+		p->cell_sum -= m->cell_sum[id];
+
+	p->cell_sum += cell_sum;
+	m->cell_sum[id] = cell_sum;
+	p->valid |= TBMS_MODULE_BIT(id);
+
+	for (int j = 0; j < TBMS_MODULE_CELLS; j++)
+		tbms_pack_put_cell(p, id, j, m->cell[id][j]);
+
+	tbms_pack_put_temp(p, id, t[0]);
+	tbms_pack_put_temp(p, id, t[1]);
+
+	//Extreme points to this module but its old value is gone
+	if ((p->cell_min_id == id &&
+	     m->cell[id][p->cell_min_cn] != p->cell_min) ||
+	    (p->cell_max_id == id &&
+	     m->cell[id][p->cell_max_cn] != p->cell_max) ||
+	    (p->temp_min_id == id &&
+	     t[0] != p->temp_min && t[1] != p->temp_min) ||
+	    (p->temp_max_id == id &&
+	     t[0] != p->temp_max && t[1] != p->temp_max))
+		tbms_pack_scan(self);
+}
 
-struct tbms
+//////////////////// POLLING ////////////////////
+/* Value read interval of module "id" from its new values, compared with
+ * the stored (previous) ones. */
+uint16_t tbms_poll_interval(struct tbms *self, uint8_t id,
+			    const tbms_volt_t *cell, const tbms_temp_t *temp)
 {
-	enum tbms_state state;
+	struct tbms_modules *m = &self->modules;
+	bool known  = (self->pack.valid & TBMS_MODULE_BIT(id)) != 0;
+	bool stable = known;
 
-	async async_state;
-	async async_task_state;
+	//Unless status was not read yet
+	if (m->status_every[id] && (m->faulted & TBMS_MODULE_BIT(id)))
+		return TBMS_POLL_FAST;
 
-	enum tbms_task_event (**current_task)(struct tbms *self);
-	
-	struct tbms_io io;
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++) {
+		tbms_volt_t old = m->cell[id][i];
 
-	struct tbms_module modules[TBMS_MAX_MODULE_ADDR];
-	uint8_t modules_count;
-	uint8_t mod_sel;
-	
-	clock_t timer;
+		if (cell[i] < TBMS_VOLTS(TBMS_POLL_CELL_LOW) ||
+		    cell[i] > TBMS_VOLTS(TBMS_POLL_CELL_HIGH))
+			return TBMS_POLL_FAST;
 
-	bool ready;
-};
+		if ((cell[i] > old ? cell[i] - old : old - cell[i]) >=
+		    TBMS_MILLIVOLTS(TBMS_POLL_STABLE_MV))
+			stable = false;
+	}
 
-void tbms_modules_init(struct tbms *self)
-{
-	for (int i = 0; i < TBMS_MAX_MODULE_ADDR; i++) {
-		struct tbms_module *mod = &self->modules[i];
+	for (int i = 0; i < 2; i++) {
+		tbms_temp_t old = m->temp[id][i];
 
-		mod->exist   = false;
-		mod->voltage = 0.0;
+		if (!known || !TBMS_TEMP_VALID(temp[i]) ||
+		    !TBMS_TEMP_VALID(old))
+			continue;
 
-		mod->temp1 = 0.0;
-		mod->temp2 = 0.0;
+		if ((temp[i] > old ? temp[i] - old : old - temp[i]) >=
+		    TBMS_DEGREES(TBMS_POLL_TEMP_STEP))
+			return TBMS_POLL_FAST;
+	}
 
-		mod->balance_bits = 0;
-		for (int j = 0; j < 6; j++)
-			mod->cell[j].voltage = NAN;
-		
-		mod->alerts = 0xFF;
-		mod->faults = 0xFF;
+	return stable ? TBMS_POLL_SLOW : TBMS_POLL_NORMAL;
+}
 
-		mod->cov_faults = 0xFF;
-		mod->cuv_faults = 0xFF;
-	}
+//Bit per module which values (or status) are due
+uint64_t tbms_poll_due(struct tbms *self, const clock_t *at,
+		       const uint16_t *every)
+{
+	uint64_t due = 0;
 
-	self->modules_count = 0;
-	self->mod_sel = 0;
+	for (int i = 0; i < TBMS_MAX_MODULES; i++)
+		if (tbms_module_exists(self, i) &&
+		    self->time - at[i] >= (clock_t)every[i])
+			due |= TBMS_MODULE_BIT(i);
+
+	return due;
 }
 
-void tbms_init(struct tbms *self)
+//ms until any module is due
+clock_t tbms_poll_next(struct tbms *self)
 {
-	self->state = TBMS_STATE_INIT;
+	struct tbms_modules *m = &self->modules;
+	clock_t next = TBMS_POLL_SLOW;
 
-	self->async_state      = 0;
-	self->async_task_state = 0;
+	for (int i = 0; i < TBMS_MAX_MODULES; i++) {
+		clock_t v, s;
 
-	self->current_task = NULL;
+		if (!tbms_module_exists(self, i))
+			continue;
 
-	tbms_io_init(&self->io);
+		v = self->time - m->values_at[i];
+		s = self->time - m->status_at[i];
 
-	tbms_modules_init(self);
-	
-	self->timer = 0;
+		v = v >= (clock_t)m->values_every[i] ? 0 :
+		    (clock_t)m->values_every[i] - v;
+		s = s >= (clock_t)m->status_every[i] ? 0 :
+		    (clock_t)m->status_every[i] - s;
 
-	self->ready = false;
+		if (v < next) next = v;
+		if (s < next) next = s;
+	}
+
+	return next;
 }
 
 //////////////////// TASK DEFINITIONS ////////////////////
 enum tbms_task_event tbms_task_discover(struct tbms *self)
 {
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_DISCOVER);
+
 	ASYNC_DISPATCH(self->async_task_state);
 
 	uint8_t cmd[] = { TBMS_BROADCAST, TBMS_REG_RESET, 0xA5 };
@@ -356,11 +1864,15 @@ enum tbms_task_event tbms_task_discover(struct tbms *self)
 
 enum tbms_task_event tbms_task_setup_boards(struct tbms *self)
 {
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_SETUP_BOARDS);
+
 	ASYNC_DISPATCH(self->async_task_state);
 
+	/* Unaddressed module replies with DEV_STATUS value and CRC,
+	 * if there is none, request comes back (see tbms_io_rx_parse) */
 	uint8_t cmd[] = { TBMS_READ, TBMS_REG_DEV_STATUS, 1 };
 
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd, 3, 3), return
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd, 3, 5), return
 		    TBMS_TASK_EVENT_NONE);
 
 	uint8_t expected_reply[]  = { 0x80, 0x00, 0x01}; //more modules ahead
@@ -371,31 +1883,26 @@ enum tbms_task_event tbms_task_setup_boards(struct tbms *self)
 		else
 			ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 	}
-	
-	//Skip bytes 0x61, 0x35 that appear after around 45us.
-	ASYNC_AWAIT(tbms_io_recv(&self->io, 2), return TBMS_TASK_EVENT_NONE);
 
 	int i;
 	
-	for (i = 0; i < TBMS_MAX_MODULE_ADDR; i++) {
-		if (!self->modules[i].exist) {
+	//More modules than memory was reserved for also ends up here
+	for (i = 0; i < TBMS_MAX_MODULES; i++) {
+		if (!tbms_module_exists(self, i)) {
 			self->mod_sel = i;
 			break;
 		}
 	}
 
-	if (i >= TBMS_MAX_MODULE_ADDR)
+	if (i >= TBMS_MAX_MODULES)
 		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
 
 	uint8_t cmd2[] = { TBMS_WRITE, TBMS_REG_ADDR_CTRL,
 		(uint8_t)((self->mod_sel + 1) | 0x80)
 	};
 
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 4/*10*/) /*||
-		    self->io.timer >= 50*/, return TBMS_TASK_EVENT_NONE);
-
-	if (self->io.len < 3)
-		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 4),
+		    return TBMS_TASK_EVENT_NONE);
 
 	uint8_t expected_reply3[] = { 
 		0x81, TBMS_REG_ADDR_CTRL,
@@ -404,9 +1911,12 @@ enum tbms_task_event tbms_task_setup_boards(struct tbms *self)
 	if (!tbms_io_validate_reply(&self->io, expected_reply3, 3))
 		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
 
-	tbms_io_rx_done(&self->io);
+	//Module has a new address, nothing is known about its registers
+	self->modules.exist |= TBMS_MODULE_BIT(self->mod_sel);
+	self->modules.shadow_valid[self->mod_sel] = 0;
 
-	self->modules[self->mod_sel].exist = true;
+	//Fault registers are not read yet (0xFF)
+	tbms_faults_update(self, self->mod_sel);
 	self->modules_count++;
 
 	//Repeat if task not yet destroyed
@@ -415,82 +1925,203 @@ enum tbms_task_event tbms_task_setup_boards(struct tbms *self)
 
 enum tbms_task_event tbms_task_clear_faults(struct tbms *self)
 {
+	bool queued;
+
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_CLEAR_FAULTS);
+
 	ASYNC_DISPATCH(self->async_task_state);
 	
 	//Select all TBMS_REG_ALERT_STATUS status bits	
 	uint8_t cmd0[] = {TBMS_BROADCAST, TBMS_REG_ALERT_STATUS,
 			  TBMS_DATA_SEL_ALL };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 4),
-		    return TBMS_TASK_EVENT_NONE);
 
 	//Clear all TBMS_REG_ALERT_STATUS status bits
 	uint8_t cmd1[] = {TBMS_BROADCAST, TBMS_REG_ALERT_STATUS,
 			  TBMS_DATA_CLR_ZRO };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd1, 3, 4),
-		    return TBMS_TASK_EVENT_NONE);
 
 	//Select all TBMS_REG_FAULT_STATUS status bits	
 	uint8_t cmd2[] = {TBMS_BROADCAST, TBMS_REG_FAULT_STATUS,
 			  TBMS_DATA_SEL_ALL };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 4),
-		    return TBMS_TASK_EVENT_NONE);
 
 	//Clear all TBMS_REG_FAULT_STATUS status bits
  	uint8_t cmd3[] = {TBMS_BROADCAST, TBMS_REG_FAULT_STATUS,
 			  TBMS_DATA_CLR_ZRO };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd3, 3, 4),
+
+	queued = tbms_io_enqueue(&self->io, cmd0, 3, 4, NULL) &&
+		 tbms_io_enqueue(&self->io, cmd1, 3, 4, NULL) &&
+		 tbms_io_enqueue(&self->io, cmd2, 3, 4, NULL) &&
+		 tbms_io_enqueue(&self->io, cmd3, 3, 4, NULL);
+
+	//Faults must not stay set because a write was dropped
+	if (!queued) {
+		assert(!"tbms_io queue is full");
+
+		tbms_io_reset(&self->io);
+		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
+	}
+
+	//All four are sent back to back
+	ASYNC_AWAIT(tbms_io_flush(&self->io), return TBMS_TASK_EVENT_NONE);
+
+	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
+}
+
+/* Checks that modules of last known topology still have their addresses
+ * and that there is no module without address. */
+enum tbms_task_event tbms_task_probe(struct tbms *self)
+{
+	struct tbms_modules *m = &self->modules;
+
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_PROBE);
+
+	ASYNC_DISPATCH(self->async_task_state);
+
+	for (self->mod_sel = 0; self->mod_sel < TBMS_MAX_MODULES;
+	     self->mod_sel++) {
+		if (!(self->topology & TBMS_MODULE_BIT(self->mod_sel)))
+			continue;
+
+		//Module without this address echoes the request and times out
+		uint8_t cmd[] = {
+			(uint8_t)(TBMS_READ | TBMS_MODULE(self->mod_sel + 1)),
+			TBMS_REG_DEV_STATUS, 1
+		};
+		ASYNC_AWAIT(tbms_io_send(&self->io, cmd, 3, 5),
+			    return TBMS_TASK_EVENT_NONE);
+
+		uint8_t expected_reply[] = {
+			TBMS_MODULE(self->mod_sel + 1), TBMS_REG_DEV_STATUS, 1
+		};
+		if (!tbms_io_validate_reply(&self->io, expected_reply, 3))
+			ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
+
+		m->exist |= TBMS_MODULE_BIT(self->mod_sel);
+		tbms_faults_update(self, self->mod_sel);
+		self->modules_count++;
+	}
+
+	//Same request as in tbms_task_setup_boards, echo means nobody is left
+	uint8_t cmd2[] = { TBMS_READ, TBMS_REG_DEV_STATUS, 1 };
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 5),
 		    return TBMS_TASK_EVENT_NONE);
 
+	uint8_t expected_reply2[] = { 0x00, 0x00, 0x01 };
+	if (!tbms_io_validate_reply(&self->io, expected_reply2, 3))
+		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_FAULT);
+
 	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 }
 
+//"data" holds TBMS_REG_ALERT_STATUS..TBMS_REG_CUV_FAULT
+void tbms_module_status_decode(struct tbms *self, uint8_t id,
+			       const uint8_t *data)
+{
+	struct tbms_modules *m = &self->modules;
+
+	m->alerts[id] = data[0];
+	m->faults[id] = data[1];
+
+	//Cell overvoltage and undervoltage faults
+	m->cov_faults[id] = data[2];
+	m->cuv_faults[id] = data[3];
+
+	tbms_faults_update(self, id);
+
+	m->status_at[id]    = self->poll_start;
+	m->status_every[id] = m->faulted & TBMS_MODULE_BIT(id) ?
+			      TBMS_POLL_FAST : TBMS_POLL_STATUS;
+}
+
 enum tbms_task_event tbms_task_read_module_status(struct tbms *self,
 						  uint8_t id)
 {
-	struct tbms_module *mod = &self->modules[id];
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_READ_STATUS);
 
 	ASYNC_DISPATCH(self->async_task_state);
 
 	uint8_t cmd0[] = {(uint8_t)(TBMS_READ | TBMS_MODULE(id + 1)),
 			  TBMS_REG_ALERT_STATUS, 4 };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 7),
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 8),
 		    return TBMS_TASK_EVENT_NONE);
 
-	mod->alerts = self->io.buf[3];
-	mod->faults = self->io.buf[4];
-
-	//Cell overvoltage and undervoltage faults
-	mod->cov_faults = self->io.buf[5];
-	mod->cuv_faults = self->io.buf[6];
+	tbms_module_status_decode(self, id, &self->io.buf[3]);
 	
 	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 }
 
-enum tbms_task_event tbms_task_read_module_values(struct tbms *self, uint8_t id)
+/* "addr" is either TBMS_BROADCAST (all modules) or
+ * (TBMS_WRITE | TBMS_MODULE(id + 1)) for a single module. */
+enum tbms_task_event tbms_task_start_conversion(struct tbms *self,
+						uint8_t addr)
 {
-	struct tbms_module *mod = &self->modules[id];
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_START_CONVERSION);
 
 	ASYNC_DISPATCH(self->async_task_state);
 	
 	//ADC Auto mode, read every ADC input we can(Both Temps, Pack, 6 cells)
-	uint8_t cmd0[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-			  TBMS_REG_ADC_CTRL, 0b00111101 };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 4),
-		    return TBMS_TASK_EVENT_NONE);
+	if (!tbms_shadow_match(self, addr, TBMS_REG_ADC_CTRL, 0b00111101)) {
+		uint8_t cmd0[] = { addr, TBMS_REG_ADC_CTRL, 0b00111101 };
+		ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 4),
+			    return TBMS_TASK_EVENT_NONE);
+
+		tbms_shadow_set(self, addr, TBMS_REG_ADC_CTRL, 0b00111101);
+	}
 
 	//enable temperature measurement VSS pins
-  	uint8_t cmd1[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-			  TBMS_REG_IO_CTRL, 0b00000011 };
-	ASYNC_AWAIT(tbms_io_send(&self->io, cmd1, 3, 4),
-		    return TBMS_TASK_EVENT_NONE);
+	if (!tbms_shadow_match(self, addr, TBMS_REG_IO_CTRL, 0b00000011)) {
+		uint8_t cmd1[] = { addr, TBMS_REG_IO_CTRL, 0b00000011 };
+		ASYNC_AWAIT(tbms_io_send(&self->io, cmd1, 3, 4),
+			    return TBMS_TASK_EVENT_NONE);
 
+		tbms_shadow_set(self, addr, TBMS_REG_IO_CTRL, 0b00000011);
+	}
 
 	//start all ADC conversions
-  	uint8_t cmd2[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-			  TBMS_REG_ADC_CONV, 1 };
+  	uint8_t cmd2[] = { addr, TBMS_REG_ADC_CONV, 1 };
 	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 4),
 		    return TBMS_TASK_EVENT_NONE);
 
+	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
+}
+
+//"data" holds TBMS_REG_GPAI..TBMS_REG_TEMPERATURE2 (18 bytes)
+void tbms_module_values_decode(struct tbms *self, uint8_t id,
+			       const uint8_t *data)
+{
+	struct tbms_modules *m = &self->modules;
+	tbms_volt_t cell[TBMS_MODULE_CELLS];
+	tbms_temp_t temp[2];
+	uint32_t cell_sum = 0;
+
+	m->voltage[id] = TBMS_MODULE_VOLT(data[0] * 256 + data[1]);
+	
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++) {
+		uint16_t raw = data[2 + (i * 2)] * 256 + data[3 + (i * 2)];
+
+		cell[i] = TBMS_CELL_VOLT(raw);
+		cell_sum += raw;
+	}
+
+	temp[0] = TBMS_TEMP(data[14] * 256 + data[15]);
+	temp[1] = TBMS_TEMP(data[16] * 256 + data[17]);
+
+	//Compared with previous values before they are replaced
+	m->values_every[id] = tbms_poll_interval(self, id, cell, temp);
+
+	memcpy(m->cell[id], cell, sizeof(cell));
+	memcpy(m->temp[id], temp, sizeof(temp));
+
+	tbms_pack_update(self, id, cell_sum);
+
+	m->values_at[id] = self->poll_start;
+}
+
+//Conversion must be started before (see tbms_task_start_conversion)
+enum tbms_task_event tbms_task_read_module_values(struct tbms *self, uint8_t id)
+{
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_READ_VALUES);
+
+	ASYNC_DISPATCH(self->async_task_state);
 
 	//start reading registers at the module voltage registers
   	//read 18 bytes (Each value takes 2 - ModuleV, CellV1-6, Temp1, Temp2)
@@ -499,107 +2130,150 @@ enum tbms_task_event tbms_task_read_module_values(struct tbms *self, uint8_t id)
 	ASYNC_AWAIT(tbms_io_send(&self->io, cmd3, 3, 22),
 		    return TBMS_TASK_EVENT_NONE);
 
-
-	int crc = tbms_gen_crc(self->io.buf, self->io.len - 1);
-        
 	uint8_t *buf = self->io.buf;
 
 	//18 data bytes, address, command, length, and CRC = 22 bytes returned
-	//Also validate CRC to ensure we didn't get garbage data.
-	//Also ensure this is actually the reply to our intended query
-	if (buf[21] == crc && buf[0] == TBMS_MODULE(id + 1) &&
+	//CRC is already validated by IO layer.
+	//Ensure this is actually the reply to our intended query
+	if (buf[0] == TBMS_MODULE(id + 1) &&
 	    buf[1] == TBMS_REG_GPAI && buf[2] == 18) {
-		//printf("CRC MATCH, EVERYTHING OK\n");
-		mod->voltage = (buf[3] * 256 + buf[4]) * 0.002034609f;
-		
-		for (int i = 0; i < 6; i++)
-			mod->cell[i].voltage = 
-				(buf[5 + (i * 2)] * 256 + buf[6 + (i * 2)]) *
-				 0.000381493f;
+		tbms_module_values_decode(self, id, &buf[3]);
+	} else {
+		//printf("CRC MISMATCH, EVERYTHING IS BAD\n");
+		TBMS_STATS_DO(self->stats.bad_replies++);
+
+		self->modules.values_every[id] = TBMS_POLL_FAST;
+		self->modules.values_at[id]    = self->poll_start;
+	}
+	
+	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
+}
 
-		float temp;
-		float temp_calc;
+/* Values and status in one read (see TBMS_BURST_READ), conversion must be
+ * started before. Reserved registers between them are skipped. */
+enum tbms_task_event tbms_task_read_module_burst(struct tbms *self, uint8_t id)
+{
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_READ_BURST);
 
-		temp = (1.78f / ((buf[17] * 256 + buf[18] + 2) /
-			    33046.0f) - 3.57f) * 1000.0f;
-		temp_calc =  1.0f / (0.0007610373573f + 
-			    (0.0002728524832 * logf(temp)) +
-			    (powf(logf(temp), 3) * 0.0000001022822735f));
+	ASYNC_DISPATCH(self->async_task_state);
 
-		mod->temp1 = temp_calc - 273.15f;     
+	uint8_t cmd[] = {(uint8_t)(TBMS_READ | TBMS_MODULE(id + 1)),
+			 TBMS_REG_GPAI, TBMS_BURST_LEN };
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd, 3, 3 + TBMS_BURST_LEN + 1),
+		    return TBMS_TASK_EVENT_NONE);
 
-		temp = (1.78f / ((buf[19] * 256 + buf[20] + 2) /
-			    33046.0f) - 3.57f) * 1000.0f;
-		temp_calc =  1.0f / (0.0007610373573f + 
-			    (0.0002728524832 * logf(temp)) +
-			    (powf(logf(temp), 3) * 0.0000001022822735f));
+	//Header and CRC are already validated by IO layer
+	uint8_t *data = &self->io.buf[3];
 
-		mod->temp2 = temp_calc - 273.15f;
+	tbms_module_values_decode(self, id, data);
+	tbms_module_status_decode(self, id,
+		&data[TBMS_REG_ALERT_STATUS - TBMS_REG_GPAI]);
 
-	} else {
-		//printf("CRC MISMATCH, EVERYTHING IS BAD\n");
-	}
-	
 	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 }
 
+//Accounts time since last evaluation to cells that were balanced
+void tbms_balance_duty_update(struct tbms *self, uint8_t id)
+{
+	struct tbms_modules *m = &self->modules;
+	clock_t elapsed = self->time - m->duty_eval[id];
+
+	m->duty_eval[id] = self->time;
+
+	if (elapsed > TBMS_BALANCE_DUTY_WINDOW)
+		elapsed = TBMS_BALANCE_DUTY_WINDOW;
+
+	m->duty_total[id] += (uint16_t)elapsed;
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++)
+		if (m->balance_bits[id] & (1 << i))
+			m->duty_on[id][i] += (uint16_t)elapsed;
+
+	if (m->duty_total[id] <= TBMS_BALANCE_DUTY_WINDOW)
+		return;
+
+	m->duty_total[id] /= 2;
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++)
+		m->duty_on[id][i] /= 2;
+}
+
+//Cells of module "id" that should be balanced against whole pack
+uint8_t tbms_balance_bits(struct tbms *self, uint8_t id)
+{
+	struct tbms_modules *m = &self->modules;
+	uint8_t bits = 0;
+
+	if (self->pack.cell_min_id == TBMS_PACK_NONE ||
+	    !(self->pack.valid & TBMS_MODULE_BIT(id)))
+		return 0;
+
+	for (int i = 0; i < TBMS_MODULE_CELLS; i++) {
+		//Do not balance if lower than balance voltage
+		//Or if within range of pack min voltage + hysteresis
+		if (m->cell[id][i] < self->bal_voltage ||
+		    m->cell[id][i] < self->pack.cell_min + self->bal_hyst)
+			continue;
+
+		bits |= (uint8_t)(1 << i);
+	}
+
+	return bits;
+}
+
 enum tbms_task_event tbms_task_balance_cells(struct tbms *self, uint8_t id)
 {
-	struct tbms_module *mod = &self->modules[id];
+	struct tbms_modules *m = &self->modules;
+	uint8_t addr = (uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1));
 
-	ASYNC_DISPATCH(self->async_task_state);
-
-	mod->balance_bits = 0; //bit 0-5 are to activate cell balancing 1-6
-
-	//Find min voltage
-	float min_voltage =  FLT_MAX;
-
-	for (int i = 0; i < 6; i++)
-		if (mod->cell[i].voltage < min_voltage)
-			min_voltage = mod->cell[i].voltage;
+	TBMS_STATS_DO(self->io.stats_task = TBMS_STATS_TASK_BALANCE);
 
-	for (int i = 0; i < 6; i++) {
-		mod->cell[i].balance = false;
+	ASYNC_DISPATCH(self->async_task_state);
 
-		//Do not balance if lower than balance voltage
-		//Or if within range of min voltage + hysteresis
-		if (mod->cell[i].voltage < TBMS_BALANCE_VOLTAGE ||
-		    mod->cell[i].voltage < (min_voltage + TBMS_BALANCE_HYST))
-			continue;
-		
-		mod->cell[i].balance = true;
+	tbms_balance_duty_update(self, id);
 
-		mod->balance_bits |= (1 << i);
-	}
+	m->balance_bits[id] = tbms_balance_bits(self, id);
 	
-	if (!mod->balance_bits)
+	//Hardware balance timer expires soon, it must be restarted
+	if (m->balance_bits[id] &&
+	    self->time - m->bal_armed[id] >= TBMS_BALANCE_REARM)
+		m->shadow_valid[id] &= ~(1 << (TBMS_REG_BAL_CTRL -
+					     TBMS_SHADOW_FIRST));
+
+	//Module already balances exactly these cells (or none)
+	if (tbms_shadow_match(self, addr, TBMS_REG_BAL_CTRL, m->balance_bits[id]))
 		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 
-	uint8_t cmd0[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-			  TBMS_REG_BAL_CTRL, 0 };
+	uint8_t cmd0[] = { addr, TBMS_REG_BAL_CTRL, 0 };
 	/* last byte resets balance time and must be done
 	   before setting balance resistors again. */
 
 	ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 4),
 		    return TBMS_TASK_EVENT_NONE);
 
-	if (mod->balance_bits) //only send balance command when needed
-	{
-		uint8_t cmd0[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-				  TBMS_REG_BAL_TIME, 130 };
-		//last byte sets balance for 130 seconds
-
-		ASYNC_AWAIT(tbms_io_send(&self->io, cmd0, 3, 4),
-			    return TBMS_TASK_EVENT_NONE);
+	tbms_shadow_set(self, addr, TBMS_REG_BAL_CTRL, 0);
 
+	if (!m->balance_bits[id]) //only send balance command when needed
+		ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 
-		uint8_t cmd1[] = {(uint8_t)(TBMS_WRITE | TBMS_MODULE(id + 1)),
-				  TBMS_REG_BAL_CTRL, mod->balance_bits };
-		//write balance state to register
+	if (!tbms_shadow_match(self, addr, TBMS_REG_BAL_TIME,
+			       TBMS_BALANCE_TIME)) {
+		uint8_t cmd1[] = { addr, TBMS_REG_BAL_TIME, TBMS_BALANCE_TIME };
+		//last byte sets balance time (see TBMS_BALANCE_TIME)
 
 		ASYNC_AWAIT(tbms_io_send(&self->io, cmd1, 3, 4),
 			    return TBMS_TASK_EVENT_NONE);
+
+		tbms_shadow_set(self, addr, TBMS_REG_BAL_TIME,
+				TBMS_BALANCE_TIME);
 	}
+
+	uint8_t cmd2[] = { addr, TBMS_REG_BAL_CTRL, m->balance_bits[id] };
+	//write balance state to register
+
+	ASYNC_AWAIT(tbms_io_send(&self->io, cmd2, 3, 4),
+		    return TBMS_TASK_EVENT_NONE);
+
+	tbms_shadow_set(self, addr, TBMS_REG_BAL_CTRL, m->balance_bits[id]);
+	m->bal_armed[id] = self->time;
 	
 	ASYNC_RESET(return TBMS_TASK_EVENT_EXIT_OK);
 }
@@ -621,13 +2295,52 @@ bool tbms_rx_available(struct tbms *self)
 	return false;
 }
 
+/* Consumes as many bytes of "data" as current reply still needs.
+ * Returns number of bytes used, the rest belongs to the next reply
+ * (or is noise) and should be kept by the caller. */
+size_t tbms_set_rx_buf(struct tbms *self, const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	if (!tbms_rx_available(self))
+		return 0;
+
+	n = tbms_io_rx(&self->io, data, len);
+
+	TBMS_TRACE_DO(if (self->trace)
+		tbms_trace_frame(self->trace, TBMS_TRACE_RX, data, n));
+
+	//Next queued request may already wait to be sent (see tbms_tx_available)
+	return n;
+}
+
+/* Zero copy alternative to tbms_set_rx_buf: read up to "len" bytes straight
+ * into returned buffer, then pass their count to tbms_rx_commit. Returns
+ * NULL if no reply is expected. */
+uint8_t *tbms_get_rx_buf(struct tbms *self, size_t *len)
+{
+	if (!tbms_rx_available(self)) {
+		*len = 0;
+		return NULL;
+	}
+
+	return tbms_io_rx_space(&self->io, len);
+}
+
+void tbms_rx_commit(struct tbms *self, size_t n)
+{
+	TBMS_TRACE_DO(if (self->trace)
+		tbms_trace_frame(self->trace, TBMS_TRACE_RX,
+				 &self->io.buf[self->io.len], n));
+
+	tbms_io_rx_commit(&self->io, n);
+}
+
 void tbms_set_rx(struct tbms *self, uint8_t byte)
 {
 	assert(tbms_rx_available(self));
-	self->io.ready = false;
 
-	assert(self->io.len < TBMS_MAX_IO_BUF);
-	self->io.buf[self->io.len++] = byte;
+	tbms_set_rx_buf(self, &byte, 1);
 }
 
 size_t tbms_get_tx_len(struct tbms *self)
@@ -640,90 +2353,368 @@ uint8_t *tbms_get_tx_buf(struct tbms *self)
 	return self->io.buf;
 }
 
+//Call when TX buffer was sent, reply can be passed right after this call
 void tbms_tx_flush(struct tbms *self)
 {
-	if (self->io.state == TBMS_IO_STATE_WAIT_FOR_SEND)
-		self->io.ready = false;
+	TBMS_TRACE_DO(if (self->trace && tbms_tx_available(self))
+		tbms_trace_frame(self->trace, TBMS_TRACE_TX, self->io.buf,
+				 self->io.len));
+
+	tbms_io_tx_done(&self->io);
 }
 
 bool tbms_has_faults(struct tbms *self)
 {
-	for (int i = 0; i < TBMS_MAX_MODULE_ADDR; i++) {
-		struct tbms_module *mod = &self->modules[i];
-		
-		if (!mod->exist)
-			continue;
-		
-		if (/*mod->alerts || */mod->faults || mod->cov_faults || 
-		    mod->cuv_faults)
-			return true;
-	}
-
-	return false;
+	return self->modules.faulted != 0;
 }
 
 //Returns true if TBMS is safe to use
 bool tbms_is_ready(struct tbms *self)
 {
-	return self->ready && !tbms_has_faults(self);
+	return self->ready && !self->modules.faulted;
+}
+
+/* Milliseconds until tbms_update has to be called again, 0 if right away.
+ * Until then only received bytes (tbms_set_rx_buf, tbms_rx_commit) can give
+ * library work, so host may sleep on UART event, poll or notification with
+ * this timeout instead of calling tbms_update in a loop. Call tbms_update
+ * after every TX/RX and ask again, the answer changes with IO state.
+ * Pending frame (tbms_tx_available) should be sent first, deadline is when
+ * it times out if port stays busy. */
+clock_t tbms_next_deadline(struct tbms *self)
+{
+	clock_t deadline;
+
+	switch (self->io.state) {
+	case TBMS_IO_STATE_WAIT_FOR_SEND:
+	case TBMS_IO_STATE_WAIT_FOR_REPLY:
+		deadline = self->io.timeout;
+		break;
+
+	case TBMS_IO_STATE_BACKOFF:
+		deadline = (clock_t)TBMS_IO_BACKOFF << (self->io.retries - 1);
+		break;
+
+	//Between sweeps, init or after a failure
+	case TBMS_IO_STATE_IDLE:
+		if (!self->sleep)
+			return 0;
+
+		return self->timer < self->sleep ? self->sleep - self->timer : 0;
+
+	//Reply to process or failure to handle
+	default:
+		return 0;
+	}
+
+	return self->io.timer < deadline ? deadline - self->io.timer : 0;
+}
+
+//Bit per module (id) that has faults, see tbms_get_fault_summary
+uint64_t tbms_get_fault_bitmap(struct tbms *self)
+{
+	return self->modules.faulted;
+}
+
+/* Bit per module (id) of last established connection. Persist it and pass
+ * it to tbms_set_topology after controller restart. */
+uint64_t tbms_get_topology(struct tbms *self)
+{
+	return self->topology;
+}
+
+/* Call after tbms_init: if modules still have these addresses (controller
+ * restarted, modules stayed powered), connection is established without
+ * the 1 s wait and discovery. Otherwise chain is discovered as usual. */
+void tbms_set_topology(struct tbms *self, uint64_t topology)
+{
+	self->topology = topology;
+}
+
+/* OR of fault registers of all faulted modules: FAULT_STATUS in bits 0-7,
+ * COV_FAULT in bits 8-15, CUV_FAULT in bits 16-23. */
+uint32_t tbms_get_fault_summary(struct tbms *self)
+{
+	return self->modules.fault_summary;
+}
+
+/* Cells above "voltage_mv" and more than "hyst_mv" above lowest cell of the
+ * pack are balanced. Takes effect on next sweep, registers are only written
+ * when resulting balance bits change. */
+void tbms_set_balance_config(struct tbms *self, uint16_t voltage_mv,
+			     uint16_t hyst_mv)
+{
+	self->bal_voltage = TBMS_MILLIVOLTS(voltage_mv);
+	self->bal_hyst    = TBMS_MILLIVOLTS(hyst_mv);
 }
 
 //////////////////// API (MODULE) ////////////////////
 #define TBMS_MODULE_METHOD_CHECKS(ret) \
-	if (id >= TBMS_MAX_MODULE_ADDR) id = TBMS_MAX_MODULE_ADDR - 1; \
-	if (!self->modules[id].exist) \
+	if (id >= TBMS_MAX_MODULES) id = TBMS_MAX_MODULES - 1; \
+	if (!tbms_module_exists(self, id)) \
 		return ret//-273.15f;
 
 float tbms_get_module_temp1(struct tbms *self, uint8_t id)
 {
 	TBMS_MODULE_METHOD_CHECKS(NAN);//-273.15f;
 
-	return self->modules[id].temp1;
+	return TBMS_TEMP_TO_F(self->modules.temp[id][0]);
 }
 
 float tbms_get_module_temp2(struct tbms *self, uint8_t id)
 {
 	TBMS_MODULE_METHOD_CHECKS(NAN);//-273.15f;
 
-	return self->modules[id].temp2;
+	return TBMS_TEMP_TO_F(self->modules.temp[id][1]);
 }
 
 float tbms_get_module_voltage(struct tbms *self, uint8_t id)
 {
 	TBMS_MODULE_METHOD_CHECKS(NAN);
 	
-	return self->modules[id].voltage;
+	return TBMS_MODULE_TO_F(self->modules.voltage[id]);
 }
 
 float tbms_get_module_cell_voltage(struct tbms* self, uint8_t id, uint8_t cn)
 {
 	TBMS_MODULE_METHOD_CHECKS(NAN);
+
+	if (cn >= TBMS_MODULE_CELLS)
+		return NAN;
 	
-	return self->modules[id].cell[cn].voltage;
+	return TBMS_CELL_TO_F(self->modules.cell[id][cn]);
 }
 
-//////////////////// UPDATE ////////////////////
-void tbms_update(struct tbms *self, clock_t delta)
+//Bit per cell (0-5) that is being balanced
+uint8_t tbms_get_module_balance_bits(struct tbms *self, uint8_t id)
 {
-	enum tbms_task_event event;
+	TBMS_MODULE_METHOD_CHECKS(0);
 
-	//Update theese in any case
-	self->io.timer += delta;
-	self->timer    += delta;
+	return self->modules.balance_bits[id];
+}
 
-	tbms_io_update(&self->io);
+//Part of time (0-1) cell was balanced, see TBMS_BALANCE_DUTY_WINDOW
+float tbms_get_module_cell_balance_duty(struct tbms *self, uint8_t id,
+					uint8_t cn)
+{
+	TBMS_MODULE_METHOD_CHECKS(NAN);
 
-	//If there is any INPUT/OUTPUT timeout
-	if (self->io.state == TBMS_IO_STATE_TIMEOUT) {
-		//Reset any running task
-		self->async_task_state = 0;
-		
-		//Goto reset state (initial)
-		self->state = TBMS_STATE_INIT;
-		self->async_state = 0;
+	if (cn >= TBMS_MODULE_CELLS)
+		return NAN;
 
-		self->ready = false;
-	}
+	if (!self->modules.duty_total[id])
+		return 0;
+
+	return (float)self->modules.duty_on[id][cn] /
+	       self->modules.duty_total[id];
+}
+
+//ms since module values were read, (clock_t)-1 if they were not yet
+clock_t tbms_get_module_age(struct tbms *self, uint8_t id)
+{
+	TBMS_MODULE_METHOD_CHECKS((clock_t)-1);
+
+	if (!(self->pack.valid & TBMS_MODULE_BIT(id)))
+		return (clock_t)-1;
+
+	return self->time - self->modules.values_at[id];
+}
+
+//////////////////// API (PACK) ////////////////////
+//Sum of all cell voltages
+float tbms_get_pack_voltage(struct tbms *self)
+{
+	if (!self->pack.valid)
+		return NAN;
+
+	return self->pack.cell_sum * TBMS_CELL_LSB;
+}
+
+//Lowest cell voltage, "id" and "cn" (module and cell) may be NULL
+float tbms_get_pack_cell_min(struct tbms *self, uint8_t *id, uint8_t *cn)
+{
+	struct tbms_pack *p = &self->pack;
+
+	if (p->cell_min_id == TBMS_PACK_NONE)
+		return NAN;
+
+	if (id) *id = p->cell_min_id;
+	if (cn) *cn = p->cell_min_cn;
+
+	return TBMS_CELL_TO_F(p->cell_min);
+}
+
+//Highest cell voltage, "id" and "cn" (module and cell) may be NULL
+float tbms_get_pack_cell_max(struct tbms *self, uint8_t *id, uint8_t *cn)
+{
+	struct tbms_pack *p = &self->pack;
+
+	if (p->cell_max_id == TBMS_PACK_NONE)
+		return NAN;
+
+	if (id) *id = p->cell_max_id;
+	if (cn) *cn = p->cell_max_cn;
+
+	return TBMS_CELL_TO_F(p->cell_max);
+}
+
+//Difference between highest and lowest cell voltage
+float tbms_get_pack_cell_delta(struct tbms *self)
+{
+	return tbms_get_pack_cell_max(self, NULL, NULL) -
+	       tbms_get_pack_cell_min(self, NULL, NULL);
+}
+
+//Lowest temperature of all sensors, "id" (module) may be NULL
+float tbms_get_pack_temp_min(struct tbms *self, uint8_t *id)
+{
+	struct tbms_pack *p = &self->pack;
+
+	if (p->temp_min_id == TBMS_PACK_NONE)
+		return NAN;
+
+	if (id) *id = p->temp_min_id;
+
+	return TBMS_TEMP_TO_F(p->temp_min);
+}
+
+//Highest temperature of all sensors, "id" (module) may be NULL
+float tbms_get_pack_temp_max(struct tbms *self, uint8_t *id)
+{
+	struct tbms_pack *p = &self->pack;
+
+	if (p->temp_max_id == TBMS_PACK_NONE)
+		return NAN;
+
+	if (id) *id = p->temp_max_id;
+
+	return TBMS_TEMP_TO_F(p->temp_max);
+}
+
+/* Age (ms) of the oldest module values, (clock_t)-1 if any module was not
+ * read yet. Stays below TBMS_POLL_SLOW plus one round of reads. */
+clock_t tbms_get_pack_age(struct tbms *self)
+{
+	clock_t age = 0;
+
+	if (!self->modules_count || self->pack.valid != self->modules.exist)
+		return (clock_t)-1;
+
+	for (int i = 0; i < TBMS_MAX_MODULES; i++)
+		if (tbms_module_exists(self, i) &&
+		    self->time - self->modules.values_at[i] > age)
+			age = self->time - self->modules.values_at[i];
+
+	return age;
+}
+
+//////////////////// API (TRACE) ////////////////////
+#ifdef TBMS_TRACE
+//Starts (or with NULL stops) recording into "trace", see tbms_trace_read
+void tbms_set_trace(struct tbms *self, struct tbms_trace *trace)
+{
+	self->trace = trace;
+}
+#endif
+
+//////////////////// API (DEBUG) ////////////////////
+#ifdef TBMS_DEBUG
+//Starts (or with NULL stops) logging into "log", see tbms_log_drain
+void tbms_set_log(struct tbms *self, struct tbms_log *log)
+{
+	self->log = log;
+}
+#endif
+
+//////////////////// API (SNAPSHOT) ////////////////////
+#ifdef TBMS_SNAPSHOT
+/* Starts (or with NULL stops) publishing into "buf" (initialized with
+ * tbms_snapshot_init), see tbms_snapshot_read */
+void tbms_set_snapshot(struct tbms *self, struct tbms_snapshot_buf *buf)
+{
+	self->snapshot = buf;
+}
+
+//Copies module data and pack aggregates, see struct tbms_snapshot
+void tbms_snapshot_publish(struct tbms *self)
+{
+	struct tbms_snapshot *s = &self->snapshot->snap;
+	struct tbms_modules  *m = &self->modules;
+
+	tbms_snapshot_begin(self->snapshot);
+
+	s->sweep = self->sweeps;
+	s->time  = self->time;
+	s->ready = tbms_is_ready(self);
+
+	s->exist         = m->exist;
+	s->faulted       = m->faulted;
+	s->fault_summary = m->fault_summary;
+	s->modules_count = self->modules_count;
+
+	memcpy(s->cell,      m->cell,      sizeof(s->cell));
+	memcpy(s->voltage,   m->voltage,   sizeof(s->voltage));
+	memcpy(s->temp,      m->temp,      sizeof(s->temp));
+	memcpy(s->values_at, m->values_at, sizeof(s->values_at));
+
+	memcpy(s->balance_bits, m->balance_bits, sizeof(s->balance_bits));
+	memcpy(s->alerts,       m->alerts,       sizeof(s->alerts));
+	memcpy(s->faults,       m->faults,       sizeof(s->faults));
+	memcpy(s->cov_faults,   m->cov_faults,   sizeof(s->cov_faults));
+	memcpy(s->cuv_faults,   m->cuv_faults,   sizeof(s->cuv_faults));
+
+	s->pack = self->pack;
+
+	tbms_snapshot_end(self->snapshot);
+}
+#endif
+
+//////////////////// API (STATISTICS) ////////////////////
+#ifdef TBMS_STATS
+//Copies current counters, see struct tbms_stats
+void tbms_get_stats(struct tbms *self, struct tbms_stats *stats)
+{
+	memcpy(stats, &self->stats, sizeof(*stats));
+}
+
+void tbms_reset_stats(struct tbms *self)
+{
+	tbms_stats_init(&self->stats);
+}
+#endif
+
+//////////////////// API (CONNECTION) ////////////////////
+/* Connection is lost (e.g. port closed): drops IO in progress, module data
+ * and faults, tbms_is_ready is false until next tbms_update has set up the
+ * chain again (last known topology is kept for warm start). */
+void tbms_disconnect(struct tbms *self)
+{
+	self->state = TBMS_STATE_INIT;
+
+	self->async_state      = 0;
+	self->async_task_state = 0;
+
+	self->current_task = NULL;
+
+	tbms_io_reset(&self->io);
+
+	tbms_modules_init(self);
+
+	self->timer = 0;
+	self->sleep = 0;
+
+	self->ready = false;
+
+	//Readers learn that connection is lost
+	TBMS_SNAPSHOT_DO(if (self->snapshot)
+		tbms_snapshot_publish(self));
+}
+
+//////////////////// UPDATE ////////////////////
+//Main state machine, see tbms_update
+void tbms_update_state(struct tbms *self)
+{
+	enum tbms_task_event event;
 
 	ASYNC_DISPATCH(self->async_state);
 
@@ -733,18 +2724,45 @@ void tbms_update(struct tbms *self, clock_t delta)
 		tbms_task_clear_faults, NULL //terminator
 	};
 
+	//Same, when modules are expected to keep their addresses
+	static enum tbms_task_event (*warm_task_list[])(struct tbms *self) = {
+		tbms_task_probe, tbms_task_clear_faults, NULL //terminator
+	};
+
 	switch (self->state) {
 	case TBMS_STATE_INIT:
 		self->ready = false;
-	
-		//Wait 1 second before initialization
-		self->timer = 0;
-		ASYNC_AWAIT(self->timer >= 1000, return);
+
+		//Readers learn that connection is lost
+		TBMS_SNAPSHOT_DO(if (self->snapshot)
+			tbms_snapshot_publish(self));
+
+		self->io.max_retries = 0; //Setup can not be repeated blindly
+		self->rereads = 0;
+
+		//Previous warm start failed, modules have to be discovered
+		if (self->warm)
+			self->topology = 0;
+
+		self->warm = self->topology != 0;
+
+		//Wait 1 second before initialization (modules power up)
+		if (!self->warm) {
+			self->sleep = 1000;
+			self->timer = 0;
+			ASYNC_AWAIT(self->timer >= self->sleep, return);
+			self->sleep = 0;
+		}
 
 		//Reset all modules state
 		tbms_modules_init(self);
 
-		self->current_task = &task_list[0];
+		TBMS_STATS_DO(self->stats.discoveries += !self->warm;
+			      self->stats.sweep_last   = 0;
+			      self->stats.sweep_period = 0);
+
+		self->current_task = self->warm ? &warm_task_list[0] :
+						  &task_list[0];
 		self->state = TBMS_STATE_ESTABLISH_CONNECTION;
 		break;
 
@@ -752,6 +2770,11 @@ void tbms_update(struct tbms *self, clock_t delta)
 	case TBMS_STATE_ESTABLISH_CONNECTION:
 		//If all tasks were done
 		if (*self->current_task == NULL) {
+			self->io.max_retries = TBMS_IO_RETRIES;
+
+			self->topology = self->modules.exist;
+			self->warm     = false;
+
 			self->state = TBMS_STATE_CONNECTION_ESTABLISHED;
 			break;
 		}
@@ -766,9 +2789,18 @@ void tbms_update(struct tbms *self, clock_t delta)
 			break;
 		}
 			
+		//Chain differs from last known topology, discover it
+		if (self->warm) {
+			self->state = TBMS_STATE_INIT;
+			self->async_state = 0;
+			break;
+		}
+
 		//Something went wrong, repeat after 1s
+		self->sleep = 1000;
 		self->timer = 0;
-		ASYNC_AWAIT(self->timer >= 1000, return);
+		ASYNC_AWAIT(self->timer >= self->sleep, return);
+		self->sleep = 0;
 
 		break;
 
@@ -780,117 +2812,144 @@ void tbms_update(struct tbms *self, clock_t delta)
 			break;
 		}
 
-		//Iterate through all modules
-		for (self->mod_sel = 0; self->mod_sel < TBMS_MAX_MODULE_ADDR;
-		     self->mod_sel++) {
-			if (!self->modules[self->mod_sel].exist)
-				continue;
+		//Only modules which values or status are due are read
+		self->poll_start  = self->time;
+		self->poll_values = tbms_poll_due(self,
+						  self->modules.values_at,
+						  self->modules.values_every);
+		self->poll_status = tbms_poll_due(self,
+						  self->modules.status_at,
+						  self->modules.status_every);
+
+#ifdef TBMS_BURST_READ
+		//Values and status come in one frame, whichever is due
+		self->poll_values |= self->poll_status;
+		self->poll_status  = 0;
+#endif
 
-			//Read module values
-			ASYNC_AWAIT(
-				tbms_task_read_module_values(self,
-							     self->mod_sel) !=
-				TBMS_TASK_EVENT_NONE, return);
+#ifndef TBMS_PER_MODULE_CONVERSION
+		//Configure and start conversion on all modules at once
+		if (self->poll_values)
+			ASYNC_AWAIT(tbms_task_start_conversion(self,
+							       TBMS_BROADCAST)
+				    != TBMS_TASK_EVENT_NONE, return);
+#endif
 
-			//Balance cells
-			ASYNC_AWAIT(
-				tbms_task_balance_cells(self, self->mod_sel) !=
-				TBMS_TASK_EVENT_NONE, return);
+		//Iterate through all modules, status follows values
+		for (self->mod_sel = 0; self->mod_sel < TBMS_MAX_MODULES;
+		     self->mod_sel++) {
+			if (self->poll_values & TBMS_MODULE_BIT(self->mod_sel)) {
+#ifdef TBMS_PER_MODULE_CONVERSION
+				ASYNC_AWAIT(
+					tbms_task_start_conversion(self,
+						(uint8_t)(TBMS_WRITE |
+						TBMS_MODULE(self->mod_sel + 1)))
+					!= TBMS_TASK_EVENT_NONE, return);
+#endif
+
+#ifdef TBMS_BURST_READ
+				ASYNC_AWAIT(
+					tbms_task_read_module_burst(self,
+						self->mod_sel) !=
+					TBMS_TASK_EVENT_NONE, return);
+#else
+				//Read module values
+				ASYNC_AWAIT(
+					tbms_task_read_module_values(self,
+						self->mod_sel) !=
+					TBMS_TASK_EVENT_NONE, return);
+#endif
+			}
 
 			//Read module status
+			if (self->poll_status & TBMS_MODULE_BIT(self->mod_sel))
+				ASYNC_AWAIT(
+					tbms_task_read_module_status(self,
+						self->mod_sel) !=
+					TBMS_TASK_EVENT_NONE, return);
+		}
+
+		/* Balance after whole pack was read, so all modules are
+		 * compared against the same pack minimum. */
+		for (self->mod_sel = 0; self->mod_sel < TBMS_MAX_MODULES;
+		     self->mod_sel++) {
+			if (!tbms_module_exists(self, self->mod_sel))
+				continue;
+
 			ASYNC_AWAIT(
-				tbms_task_read_module_status(self,
-							     self->mod_sel) !=
+				tbms_task_balance_cells(self, self->mod_sel) !=
 				TBMS_TASK_EVENT_NONE, return);
 		}
 
 		self->ready = true;
-		
+		self->rereads = 0;
+		self->sweeps++;
+
+		TBMS_STATS_DO(tbms_stats_sweep(&self->stats, self->time));
+
+		TBMS_SNAPSHOT_DO(if (self->snapshot)
+			tbms_snapshot_publish(self));
+
+		//Sleep until any module is due
+		self->sleep = tbms_poll_next(self);
 		self->timer = 0;
-		ASYNC_AWAIT(self->timer >= 1000, return);
-		
+		ASYNC_AWAIT(self->timer >= self->sleep, return);
+		self->sleep = 0;
+
 		break;
 	}
 	
 	ASYNC_RESET(return);
 }
 
-//////////////////// DEBUG ////////////////////
-#ifdef   TBMS_DEBUG
-struct tbms_debug
+void tbms_update(struct tbms *self, clock_t delta)
 {
-	struct tbms tb;
-	
-	uint8_t io_flags;
-	uint8_t io_state;
-	
-	clock_t timestamp;
-};
+	bool reread = false;
 
-void tbms_init_debug(struct tbms_debug *self)
-{
-	self->io_state = 0;
-	self->io_flags = 0;
+	TBMS_TRACE_DO(if (self->trace)
+		tbms_trace_update(self->trace, delta));
 
-	self->timestamp = 0;
+	//Update theese in any case
+	self->io.timer += delta;
+	self->timer    += delta;
+	self->time     += delta;
 
-	tbms_init(&self->tb);
-}
+	tbms_io_update(&self->io);
 
-void tbms_update_debug(struct tbms_debug *self, clock_t delta)
-{
-	tbms_update(&self->tb, delta);
+	//If there is any INPUT/OUTPUT timeout
+	if (self->io.state == TBMS_IO_STATE_TIMEOUT) {
+		//Reset any running task
+		self->async_task_state = 0;
 
-	if (self->io_state != self->tb.io.state) {
-		printf("[% 3i] tbms.io.state: %s -> %s\n",
-			(int)self->timestamp,
-		//printf("tbms.io.state: %s -> %s\n",
-			tbms_io_get_state_name(self->io_state),
-			tbms_io_get_state_name(self->tb.io.state));
-		self->io_state = self->tb.io.state;	
-	}
-	
-	if (tbms_tx_available(&self->tb)) {
-		printf("[% 3i] tbms.io.txbuf: ", (int)self->timestamp);
-		//printf("tbms.io.txbuf: ");
+		//Registers may or may not be written, forget them
+		tbms_shadow_invalidate(self);
+
+		self->ready = false;
 
-		for (size_t i = 0; i < tbms_get_tx_len(&self->tb); i++)
-			printf("0x%02X ", tbms_get_tx_buf(&self->tb)[i]);
+		/* Re-read current module: state machine still waits for the
+		 * task, which starts over once IO is reset (next update). */
+		if (self->state == TBMS_STATE_CONNECTION_ESTABLISHED &&
+		    self->rereads < TBMS_REREADS) {
+			TBMS_STATS_DO(self->stats.rereads++);
 
-		printf("\n");
+			self->rereads++;
+			reread = true;
+		} else {
+			//Goto reset state (initial)
+			self->state = TBMS_STATE_INIT;
+			self->async_state = 0;
+		}
 	}
-	
-	if (self->io_state == TBMS_IO_STATE_RX_DONE ||
-	    self->io_state == TBMS_IO_STATE_TIMEOUT) {
-		printf("[% 3i] tbms.io.rxbuf: ", (int)self->timestamp);
-		//printf("tbms.io.rxbuf: ");
 
-		for (size_t i = 0; i < self->tb.io.len; i++)
-			printf("0x%02X ", self->tb.io.buf[i]);
+	if (!reread)
+		tbms_update_state(self);
 
-		printf("\n");
-	}
-	
-	self->timestamp += delta;
-}
-
-typedef struct tbms tbms_orig;
-#define tbms_tx_available(s) tbms_tx_available((tbms_orig *)s)
-#define tbms_get_tx_len(s)   tbms_get_tx_len((tbms_orig *)s)
-#define tbms_get_tx_buf(s)   tbms_get_tx_buf((tbms_orig *)s)
-#define tbms_tx_flush(s)     tbms_tx_flush((tbms_orig *)s)
-#define tbms_rx_available(s) tbms_rx_available((tbms_orig *)s)
-#define tbms_set_rx(s, a)    tbms_set_rx((tbms_orig *)s, a)
-#define tbms_is_ready(s)     tbms_is_ready((tbms_orig *)s)
-#define tbms_get_module_temp1(s, a) \
-	tbms_get_module_temp1((tbms_orig *)s, a)
-#define tbms_get_module_voltage(s, a) \
-	tbms_get_module_voltage((tbms_orig *)s, a)
-#define tbms_get_module_cell_voltage(s, a, b) \
-	tbms_get_module_cell_voltage((tbms_orig *)s, a, b)
-	
-#define tbms        tbms_debug
-#define tbms_init   tbms_init_debug
-#define tbms_update tbms_update_debug
+	TBMS_TRACE_DO(if (self->trace)
+		tbms_trace_state(self->trace, (uint8_t)self->state,
+				 (uint8_t)self->io.state));
+
+	TBMS_DEBUG_DO(if (self->log)
+		tbms_log_io(self->log, self->time, &self->io));
+}
 
-#endif //TBMS_DEBUG
+#endif //TESLA_BMS_H
@@ -1,41 +1,19 @@
 #ifndef ARDUINO
 #define TBMS_DEBUG
+#define TBMS_STATS
 #include "tesla_bms.h"
+#include "tbms_emu.h"
 
 struct tbms tb;
 
-static uint8_t reply[] = {
-	0x7F, 0x3C, 0xA5, 0x57, //reply for discover message
+//Library debug records, printed after each update
+struct tbms_log tb_log;
 
-	//Discovery (first module)
-	0x80, 0x00, 0x01, 0x61, 0x35,
-	0x81, 0x3B, 0x81, 0x8B,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+//Oldest values seen while ready (see TBMS_POLL_SLOW)
+clock_t max_pack_age;
 
-	//Discovery (second module)
-	0x80, 0x00, 0x01, 0x61, 0x35,
-	0x81, 0x3B, 0x82, 0x8B,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	
-	//Discovery (no more modules)
-	0x00, 0x00, 0x01,
-	
-	//Clear faults (reply same as request)
-	0x7F, 0x20, 0xFF, 0x7D,
-	0x7F, 0x20, 0x00, 0x8E,
-	0x7F, 0x21, 0xFF, 0x68,
-	0x7F, 0x21, 0x00, 0x9B,
-	
-	//Module values
-	//{+Module 0 voltage:  16.877081+}
-	//{+Module 0 temp1:    23.567810+}
-	0x03, 0x30, 0x3D, 0xF7,
-	0x03, 0x31, 0x03, 0x58,
-	0x03, 0x34, 0x01, 0x17,
-	0x02, 0x01, 0x12, 0x20, 0x67, 0x23, 0x76, 0x22, 0xA2, 0x00, 0x01, 0x24,
-			  0xFD, 0x25, 0xE7, 0x00, 0x00, 0x10, 0x42, 0x00, 0x04,
-			  0xBD
-};
+//Virtual module chain the library talks to
+struct tbms_emu emu;
 
 void print_stats(clock_t delta)
 {
@@ -60,35 +38,198 @@ void print_stats(clock_t delta)
 	ASYNC_RESET(return);
 }
 
-static uint8_t reply_i = 0;
+//Steinhart-Hart equation that tbms_temp_lut was generated from
+float temp_reference(uint16_t raw)
+{
+	float temp = (1.78f / ((raw + 2) / 33046.0f) - 3.57f) * 1000.0f;
+
+	return 1.0f / (0.0007610373573f + (0.0002728524832 * logf(temp)) +
+		       (powf(logf(temp), 3) * 0.0000001022822735f)) - 273.15f;
+}
+
+//Compile with -DTBMS_GEN_TEMP_LUT to print tbms_temp_lut
+void temp_gen_lut()
+{
+	for (int i = 0; i <= (TBMS_TEMP_RAW_MAX >> TBMS_TEMP_LUT_SHIFT) + 1;
+	     i++) {
+		float t = temp_reference(i << TBMS_TEMP_LUT_SHIFT);
+		long  v = (isnan(t) || t > 327.67f) ? 32767 : lrintf(t * 100);
+
+		printf("%s%6ld,", (i % 8) ? " " : "\n\t", v);
+	}
+
+	printf("\n");
+}
+
+//Whole 16 bit ADC range against reference equation
+void temp_test()
+{
+	float max_err[2] = { 0.0f, 0.0f };
+	float prev = -FLT_MAX;
+	bool  ok = true;
+
+	for (uint32_t raw = 0; raw <= UINT16_MAX; raw++) {
+		float ref = temp_reference(raw);
+		float t   = tbms_temp_from_raw(raw);
+		float err = fabsf(t - ref);
+
+		//Shorted thermistor
+		if (isnan(ref) || isnan(t)) {
+			ok = ok && isnan(ref) && isnan(t);
+			continue;
+		}
+
+		if (ref >= -40.0f && ref <= 125.0f && err > max_err[0])
+			max_err[0] = err;
+
+		if (ref >= -60.0f && ref <= 200.0f && err > max_err[1])
+			max_err[1] = err;
+
+		/* Outside of -60..200C thermistor is open or shorted, only
+		 * order of values must be kept there */
+		if (t < prev)
+			ok = false;
+
+		prev = t;
+	}
+
+	ok = ok && max_err[0] < 0.1f && max_err[1] < 1.0f;
+
+	printf("Thermistor table error within bounds: %s\n", ok ? "yes" : "no");
+}
+
+void print_counters()
+{
+	struct tbms_stats st;
+
+	tbms_get_stats(&tb, &st);
+
+	printf("Frames: %u, bytes TX %u RX %u\n", (unsigned)st.tx_frames,
+	       (unsigned)st.tx_bytes, (unsigned)st.rx_bytes);
+	printf("Timeouts: %u, CRC errors: %u, bad replies: %u, noise: %u\n",
+	       (unsigned)st.timeouts, (unsigned)st.crc_errors,
+	       (unsigned)st.bad_replies, (unsigned)st.noise);
+	printf("Retries: %u, re-reads: %u\n", (unsigned)st.retries,
+	       (unsigned)st.rereads);
+	printf("Discoveries: %u, sweeps: %u, period %li..%li ms\n",
+	       (unsigned)st.discoveries, (unsigned)st.sweeps,
+	       (long)st.sweep_period_min, (long)st.sweep_period_max);
+
+	printf("Round trips (read values):");
+	for (int i = 0; i < TBMS_STATS_BUCKETS; i++)
+		printf(" %u", (unsigned)
+		       st.rtt_task[TBMS_STATS_TASK_READ_VALUES][i]);
+	printf("\n");
+
+	printf("Sweep jitter:");
+	for (int i = 0; i < TBMS_STATS_BUCKETS; i++)
+		printf(" %u", (unsigned)st.sweep_jitter[i]);
+	printf("\n");
+}
 
 void update()
 {
 	print_stats(1);
 
-	//Send and flush
-	if (tbms_tx_available(&tb))
+	//Send and flush, anything unread is stale (like UART RX flush)
+	if (tbms_tx_available(&tb)) {
+		tbms_emu_flush(&emu);
+		tbms_emu_write(&emu, tbms_get_tx_buf(&tb), tbms_get_tx_len(&tb));
 		tbms_tx_flush(&tb);
-	
-				   //UNCOMMENT TO TEST TIMEOUT
-	if (tbms_rx_available(&tb) /* && reply_i < 50 */) {
-		tbms_set_rx(&tb, reply[reply_i]);
-		
-		if (reply_i < sizeof(reply) - 1)
-			reply_i++;
 	}
 
+	//Chain replies straight into library buffer
+	if (tbms_rx_available(&tb)) {
+		size_t len;
+		uint8_t *buf = tbms_get_rx_buf(&tb, &len);
+
+		tbms_rx_commit(&tb, tbms_emu_read(&emu, buf, len));
+	}
+
+	tbms_emu_update(&emu, 1);
 	tbms_update(&tb, 1);
+
+	tbms_log_drain(&tb_log, stdout, 0);
+
+	if (tbms_is_ready(&tb) && tbms_get_pack_age(&tb) > max_pack_age)
+		max_pack_age = tbms_get_pack_age(&tb);
+}
+
+//Controller restart, returns ms until library is ready (or -1)
+int restart(uint64_t topology)
+{
+	tbms_init(&tb);
+	tbms_set_log(&tb, &tb_log);
+	tbms_set_topology(&tb, topology);
+
+	for (int i = 0; i < 5000; i++) {
+		update();
+
+		if (tbms_is_ready(&tb))
+			return i + 1;
+	}
+
+	return -1;
 }
 
 int main()
 {
+#ifdef TBMS_GEN_TEMP_LUT
+	temp_gen_lut();
+	return 0;
+#endif
+	temp_test();
+
+	tbms_emu_init(&emu, 2);
+	tbms_emu_set_cell(&emu, 0, 2, 3.812f);
+	tbms_emu_set_cell(&emu, 1, 4, 3.650f);
+
 	tbms_init(&tb);
+	tbms_log_init(&tb_log);
+	tbms_set_log(&tb, &tb_log);
+
+	for (int i = 0; i < 2500; i++)
+		update();
+
+	printf("%i modules detected!\n", tb.modules_count);
+	printf("Ready: %s\n", tbms_is_ready(&tb) ? "yes" : "no");
+
+	//Corrupted reply is simply repeated
+	tbms_emu_inject(&emu, TBMS_EMU_ERROR_BAD_CRC, 1);
+
+	for (int i = 0; i < 2500; i++)
+		update();
+
+	//Stray bytes before replies are skipped, nothing is repeated
+	tbms_emu_inject(&emu, TBMS_EMU_ERROR_NOISE, 4);
 
-	for (int i = 0; i < 2000; i++)
+	for (int i = 0; i < 1500; i++)
 		update();
 
-	printf("%i modules detected!\n", tb.tb.modules_count);
+	//Request lost more times than it is repeated, module is read again
+	tbms_emu_inject(&emu, TBMS_EMU_ERROR_NO_REPLY, TBMS_IO_RETRIES + 1);
+
+	for (int i = 0; i < 1500; i++)
+		update();
+
+	printf("%i modules detected!\n", tb.modules_count);
+	printf("Ready: %s\n", tbms_is_ready(&tb) ? "yes" : "no");
+	printf("Pack voltage: %f\n", tbms_get_pack_voltage(&tb));
+	printf("Pack cell delta: %f\n", tbms_get_pack_cell_delta(&tb));
+
+	print_counters();
+
+	printf("Max pack age: %li ms\n", (long)max_pack_age);
+
+	//Modules kept their addresses, no discovery needed
+	printf("Warm start ready after %i ms\n",
+	       restart(tbms_get_topology(&tb)));
+
+	//Modules were power cycled, probe fails and chain is discovered
+	tbms_emu_init(&emu, 2);
+	printf("Failed warm start ready after %i ms\n",
+	       restart(tbms_get_topology(&tb)));
+	printf("%i modules detected!\n", tb.modules_count);
 
 	//static uint8_t data[4] = {0x80, 0x00, 0x01};
 	//tbms_gen_request(data, 3);